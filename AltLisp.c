@@ -1,4 +1,9 @@
 #include "mpc.h"
+#include <limits.h>
+#include <stdint.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #ifdef _WIN32
 
@@ -18,27 +23,28 @@ void add_history(char* unused) {}
 #else
 #include <editline/readline.h>
 #include <editline/history.h>
+#include <pthread.h>
+#include <unistd.h>
 #endif
 
-/* Parser Declariations */
-
-mpc_parser_t* Number; 
-mpc_parser_t* Integer; 
-mpc_parser_t* Double; 
-mpc_parser_t* Symbol; 
-mpc_parser_t* String; 
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;  
-mpc_parser_t* Qexpr;  
-mpc_parser_t* Expr; 
-mpc_parser_t* Lispy;
-
 /* Forward Declarations */
 
 struct lval;
 struct lenv;
+struct lreader;
+struct lbuilder;
+struct lstr;
+struct lmap;
+struct lhamt;
+struct lcases;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lreader lreader;
+typedef struct lbuilder lbuilder;
+typedef struct lstr lstr;
+typedef struct lmap lmap;
+typedef struct lhamt lhamt;
+typedef struct lcases lcases;
 /*typedef union dataType {
     double d; long l;
 }number;*/
@@ -56,13 +62,206 @@ typedef struct dataType{
     } value;
 }number;
 
+/* Strings */
+
+/*
+** Strings never change once made, so every copy of a
+** string value shares one reference counted lstr.
+** A flat node owns its bytes, a slice points into the
+** bytes of a flat node it keeps alive, and a concat
+** node joins two strings as a rope without copying
+** either. A rope is only flattened, in place, when its
+** bytes are needed in one piece.
+**
+** The length is stored and the hash is worked out
+** the first time it is needed and then kept, so
+** strings which differ can usually be told apart
+** without looking at their bytes.
+*/
+
+enum { LSTR_FLAT, LSTR_SLICE, LSTR_CONCAT };
+
+/* Shorter results are copied flat, deeper ropes are flattened */
+enum { LSTR_SHORT = 64, LSTR_DEPTH_MAX = 48 };
+
+struct lstr {
+  int kind;
+  int refs;
+  int depth;
+  size_t len;
+  unsigned long hash;
+  char* bytes;
+  lstr* base;
+  lstr* left;
+  lstr* right;
+};
+
+/* Takes ownership of s, which must have a NUL at s[len] */
+lstr* lstr_take(char* s, size_t len) {
+  lstr* x = calloc(1, sizeof(lstr));
+  x->kind = LSTR_FLAT;
+  x->refs = 1;
+  x->len = len;
+  x->bytes = s;
+  return x;
+}
+
+lstr* lstr_new(const char* s, size_t len) {
+  char* b = malloc(len + 1);
+  memcpy(b, s, len);
+  b[len] = '\0';
+  return lstr_take(b, len);
+}
+
+lstr* lstr_retain(lstr* s) {
+  s->refs++;
+  return s;
+}
+
+void lstr_release(lstr* s) {
+  if (--s->refs > 0) { return; }
+  switch (s->kind) {
+    case LSTR_FLAT: free(s->bytes); break;
+    case LSTR_SLICE: lstr_release(s->base); break;
+    case LSTR_CONCAT: lstr_release(s->left); lstr_release(s->right); break;
+  }
+  free(s);
+}
+
+static void lstr_copy_to(lstr* s, char* out) {
+  if (s->kind == LSTR_CONCAT) {
+    lstr_copy_to(s->left, out);
+    lstr_copy_to(s->right, out + s->left->len);
+  } else {
+    memcpy(out, s->bytes, s->len);
+  }
+}
+
+/* Turn any node into a flat one holding the same bytes */
+static void lstr_flatten(lstr* s) {
+  char* b = malloc(s->len + 1);
+  lstr_copy_to(s, b);
+  b[s->len] = '\0';
+  if (s->kind == LSTR_SLICE) { lstr_release(s->base); }
+  if (s->kind == LSTR_CONCAT) { lstr_release(s->left); lstr_release(s->right); }
+  s->kind = LSTR_FLAT;
+  s->depth = 0;
+  s->bytes = b;
+}
+
+/* The bytes in one piece, not always followed by a NUL */
+const char* lstr_data(lstr* s) {
+  if (s->kind == LSTR_CONCAT) { lstr_flatten(s); }
+  return s->bytes;
+}
+
+/* The bytes as a C string, which must not be changed */
+char* lstr_cstr(lstr* s) {
+  if (s->kind == LSTR_CONCAT
+  || (s->kind == LSTR_SLICE && s->bytes[s->len] != '\0')) {
+    lstr_flatten(s);
+  }
+  return s->bytes;
+}
+
+static unsigned long lstr_hash_bytes(lstr* s, unsigned long h) {
+  if (s->kind == LSTR_CONCAT) {
+    return lstr_hash_bytes(s->right, lstr_hash_bytes(s->left, h));
+  }
+  for (size_t i = 0; i < s->len; i++) {
+    h = (h ^ (unsigned char)s->bytes[i]) * 16777619UL;
+  }
+  return h;
+}
+
+/* FNV-1a, with 0 kept to mean not worked out yet */
+unsigned long lstr_hash(lstr* s) {
+  if (s->hash == 0) {
+    unsigned long h = lstr_hash_bytes(s, 2166136261UL) & 0xFFFFFFFFUL;
+    s->hash = h ? h : 1;
+  }
+  return s->hash;
+}
+
+int lstr_eq(lstr* x, lstr* y) {
+  if (x == y) { return 1; }
+  if (x->len != y->len) { return 0; }
+  if (lstr_hash(x) != lstr_hash(y)) { return 0; }
+  return memcmp(lstr_data(x), lstr_data(y), x->len) == 0;
+}
+
+/* Joins x and y, taking the references to both */
+lstr* lstr_concat(lstr* x, lstr* y) {
+  if (x->len == 0) { lstr_release(x); return y; }
+  if (y->len == 0) { lstr_release(y); return x; }
+  
+  size_t len = x->len + y->len;
+  if (len < LSTR_SHORT) {
+    char* b = malloc(len + 1);
+    lstr_copy_to(x, b);
+    lstr_copy_to(y, b + x->len);
+    b[len] = '\0';
+    lstr_release(x); lstr_release(y);
+    return lstr_take(b, len);
+  }
+  
+  lstr* s = calloc(1, sizeof(lstr));
+  s->kind = LSTR_CONCAT;
+  s->refs = 1;
+  s->len = len;
+  s->left = x;
+  s->right = y;
+  s->depth = (x->depth > y->depth ? x->depth : y->depth) + 1;
+  if (s->depth > LSTR_DEPTH_MAX) { lstr_flatten(s); }
+  return s;
+}
+
+/* Bytes [start, start+len) of s, taking the reference to s */
+lstr* lstr_slice(lstr* s, size_t start, size_t len) {
+  if (start == 0 && len == s->len) { return s; }
+  
+  /* Short slices are copied so they don't keep a big buffer alive */
+  if (len < LSTR_SHORT) {
+    lstr* x = lstr_new(lstr_data(s) + start, len);
+    lstr_release(s);
+    return x;
+  }
+  
+  if (s->kind == LSTR_CONCAT) { lstr_flatten(s); }
+  lstr* base = s;
+  if (s->kind == LSTR_SLICE) {
+    start += s->bytes - s->base->bytes;
+    base = lstr_retain(s->base);
+    lstr_release(s);
+  }
+  
+  lstr* x = calloc(1, sizeof(lstr));
+  x->kind = LSTR_SLICE;
+  x->refs = 1;
+  x->len = len;
+  x->base = base;
+  x->bytes = base->bytes + start;
+  return x;
+}
+
 /* Lisp Value */
 
 enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, 
-       LVAL_FUN, LVAL_OBJ, LVAL_INST, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_OBJ, LVAL_INST, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_BUILDER, LVAL_MAP, LVAL_HAMT };
        
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/*
+** A special form is given the whole expression it
+** heads with its arguments still unevaluated, so it
+** can evaluate only what it needs. The expression is
+** only borrowed: it must not be deleted, changed or
+** kept. Returning NULL hands it back to be evaluated
+** as an ordinary call to the builtin.
+*/
+typedef lval*(*lspecial)(lenv*, lval*);
+
 typedef int bool;
 #define true 1;
 #define false 0;
@@ -81,10 +280,12 @@ struct lval {
   
   char* err;
   char* sym;
-  char* str;
+  lstr* str;
   
   /* Function */
   lbuiltin builtin;
+  lspecial special;
+  int macro;
   lenv* env;
   lval* formals;
   lval* body;
@@ -100,9 +301,18 @@ struct lval {
   lval* memberVariables;
   char* name;
   
+  /* String builder */
+  lbuilder* builder;
+  
+  /* Hash map */
+  lmap* map;
+  lhamt* hamt;
+  
   /* Expression */
   int count;
   lval** cell;
+  lcases* cases;
+  int refs; // Lambdas sharing this as their body
 };
 
 lval* lval_num(number x) {
@@ -154,15 +364,25 @@ lval* lval_objBuiltin(lbuiltin obj)
 lval* lval_str(char* s) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+  v->str = lstr_new(s, strlen(s));
   return v;
 }
 
+lval* lval_lstr(lstr* s) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->str = s;
+  return v;
+}
+
+lspecial lbuiltin_special(lbuiltin func);
+
 lval* lval_builtin(lbuiltin func) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_FUN;
   v->builtin = func;
+  v->special = lbuiltin_special(func);
+  v->macro = 0;
   return v;
 }
 
@@ -195,13 +415,17 @@ lval* lval_object(lval* objSlots)
 	return v;
 }
 
+/* A body is never changed once it is made, so every copy of the lambda shares it, counted in its refs */
 lval* lval_lambda(lval* formals, lval* body) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_FUN;  
   v->builtin = NULL;  
+  v->special = NULL;
+  v->macro = 0;
   v->env = lenv_new();  
   v->formals = formals;
   v->body = body;
+  body->refs = 1;
   return v;  
 }
 
@@ -210,6 +434,7 @@ lval* lval_sexpr(void) {
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->cases = NULL;
   return v;
 }
 
@@ -218,10 +443,15 @@ lval* lval_qexpr(void) {
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->cases = NULL;
   return v;
 }
 
 void lenv_del(lenv* e);
+void lbuilder_release(lbuilder* b);
+void lmap_release(lmap* m);
+void lhamt_release(lhamt* n);
+void lcases_del(lcases* t);
 
 void lval_del(lval* v) {
 
@@ -231,7 +461,7 @@ void lval_del(lval* v) {
       if (!v->builtin) {
         lenv_del(v->env);
         lval_del(v->formals);
-        lval_del(v->body);
+        if (--v->body->refs == 0) { lval_del(v->body); }
       }
     break;
 	case LVAL_OBJ:
@@ -247,13 +477,17 @@ void lval_del(lval* v) {
 	break;
     case LVAL_ERR: free(v->err); break;
     case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
+    case LVAL_STR: lstr_release(v->str); break;
+    case LVAL_BUILDER: lbuilder_release(v->builder); break;
+    case LVAL_MAP: lmap_release(v->map); break;
+    case LVAL_HAMT: if (v->hamt) { lhamt_release(v->hamt); } break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       for (int i = 0; i < v->count; i++) {
         lval_del(v->cell[i]);
       }
       free(v->cell);
+      if (v->cases) { lcases_del(v->cases); }
     break;
   }
   
@@ -261,6 +495,9 @@ void lval_del(lval* v) {
 }
 
 lenv* lenv_copy(lenv* e);
+lbuilder* lbuilder_retain(lbuilder* b);
+lmap* lmap_retain(lmap* m);
+lhamt* lhamt_retain(lhamt* n);
 
 lval* lval_copy(lval* v) {
   lval* x = malloc(sizeof(lval));
@@ -269,11 +506,16 @@ lval* lval_copy(lval* v) {
     case LVAL_FUN:
       if (v->builtin) {
         x->builtin = v->builtin;
+        x->special = v->special;
+        x->macro = 0;
       } else {
         x->builtin = NULL;
+        x->special = NULL;
+        x->macro = v->macro;
         x->env = lenv_copy(v->env);
         x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
+        x->body = v->body;
+        x->body->refs++;
       }
     break;
 	case LVAL_OBJ:
@@ -310,12 +552,14 @@ lval* lval_copy(lval* v) {
     case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym);
     break;
-    case LVAL_STR: x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str);
-    break;
+    case LVAL_STR: x->str = lstr_retain(v->str); break;
+    case LVAL_BUILDER: x->builder = lbuilder_retain(v->builder); break;
+    case LVAL_MAP: x->map = lmap_retain(v->map); break;
+    case LVAL_HAMT: x->hamt = v->hamt ? lhamt_retain(v->hamt) : NULL; break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
+      x->cases = NULL;
       x->cell = malloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
@@ -356,68 +600,427 @@ lval* lval_take(lval* v, int i) {
   return x;
 }
 
-void lval_print(lval* v);
+/* Number Printing */
+
+/*
+** Integers are written out digit by digit, and doubles
+** with Grisu2, which finds a short string of digits
+** that reads back as exactly the same double without
+** any big number arithmetic. A double is printed as
+** an integer followed by ".0" when it has no fraction,
+** so it can still be told apart from an integer. The
+** reader has no exponent syntax, so very large and
+** very small doubles are written out in full.
+*/
+
+int lnum_fmt_long(char* buf, long x) {
+  char tmp[24];
+  int n = 0, len = 0;
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  do { tmp[n++] = (char)('0' + u % 10); u /= 10; } while (u);
+  if (x < 0) { buf[len++] = '-'; }
+  while (n) { buf[len++] = tmp[--n]; }
+  buf[len] = '\0';
+  return len;
+}
+
+typedef struct { uint64_t f; int e; } ldiyfp;
+
+static const uint64_t lgrisu_pow_f[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const short lgrisu_pow_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+  -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+  -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+  -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+  56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+  694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+  1013, 1039, 1066
+};
+
+static const uint32_t lgrisu_pow10[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static ldiyfp ldiyfp_mul(ldiyfp x, ldiyfp y) {
+  const uint64_t m32 = 0xFFFFFFFFu;
+  uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32) + (1U << 31);
+  ldiyfp r = { ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+  return r;
+}
+
+/* Leading zero bits of a non-zero word */
+static int lclz64(uint64_t x) {
+#if defined(__GNUC__)
+  return __builtin_clzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long i;
+  _BitScanReverse64(&i, x);
+  return 63 - (int)i;
+#else
+  int n = 0;
+  while (!(x & ((uint64_t)1 << 63))) { x <<= 1; n++; }
+  return n;
+#endif
+}
+
+static ldiyfp ldiyfp_normalize(ldiyfp x) {
+  int s = lclz64(x.f);
+  ldiyfp r = { x.f << s, x.e - s };
+  return r;
+}
+
+static void lgrisu_round(char* buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+  while (rest < wp_w && delta - rest >= ten_kappa
+    && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len-1]--;
+    rest += ten_kappa;
+  }
+}
+
+static int lgrisu_digits(ldiyfp w, ldiyfp mp, uint64_t delta, char* buf, int* k) {
+  ldiyfp one = { (uint64_t)1 << -mp.e, mp.e };
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = 1, len = 0;
+  while (kappa < 10 && p1 >= lgrisu_pow10[kappa]) { kappa++; }
+  
+  while (kappa > 0) {
+    uint32_t d = p1 / lgrisu_pow10[kappa-1];
+    p1 %= lgrisu_pow10[kappa-1];
+    if (d || len) { buf[len++] = (char)('0' + d); }
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      lgrisu_round(buf, len, delta, rest, (uint64_t)lgrisu_pow10[kappa] << -one.e, wp_w);
+      return len;
+    }
+  }
+  
+  while (1) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || len) { buf[len++] = (char)('0' + d); }
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      lgrisu_round(buf, len, delta, p2, one.f, wp_w * lgrisu_pow10[-kappa]);
+      return len;
+    }
+  }
+}
+
+/* Digits of a positive finite double, with the value being digits * 10^k */
+static int lgrisu2(double x, char* buf, int* k) {
+  uint64_t u;
+  memcpy(&u, &x, sizeof(u));
+  int be = (int)((u >> 52) & 0x7FF);
+  ldiyfp v = { u & 0xFFFFFFFFFFFFFULL, -1074 };
+  if (be) { v.f += (uint64_t)1 << 52; v.e = be - 1075; }
+  
+  /* The boundaries halfway to the neighbouring doubles */
+  ldiyfp pl = ldiyfp_normalize((ldiyfp){ (v.f << 1) + 1, v.e - 1 });
+  ldiyfp mi = (v.f == (uint64_t)1 << 52)
+    ? (ldiyfp){ (v.f << 2) - 1, v.e - 2 }
+    : (ldiyfp){ (v.f << 1) - 1, v.e - 1 };
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  
+  /* Scale by a cached power of ten so the digits come out of the top word */
+  double dk = (-61 - pl.e) * 0.30102999566398114 + 347;
+  int ki = (int)dk;
+  if (dk - ki > 0.0) { ki++; }
+  int index = (ki >> 3) + 1;
+  *k = -(-348 + index * 8);
+  ldiyfp c = { lgrisu_pow_f[index], lgrisu_pow_e[index] };
+  
+  ldiyfp w = ldiyfp_mul(ldiyfp_normalize(v), c);
+  ldiyfp wp = ldiyfp_mul(pl, c);
+  ldiyfp wm = ldiyfp_mul(mi, c);
+  wm.f++;
+  wp.f--;
+  return lgrisu_digits(w, wp, wp.f - wm.f, buf, k);
+}
+
+int lnum_fmt_double(char* buf, double x) {
+  int len = 0;
+  
+  if (isnan(x)) { strcpy(buf, "nan"); return 3; }
+  if (signbit(x)) { buf[len++] = '-'; x = -x; }
+  if (isinf(x)) { strcpy(buf + len, "inf"); return len + 3; }
+  if (x == 0.0) { strcpy(buf + len, "0.0"); return len + 3; }
+  
+  char d[20];
+  int k, n = lgrisu2(x, d, &k);
+  int point = n + k;
+  
+  if (k >= 0) {
+    /* 1234e5 -> 123400000.0 */
+    memcpy(buf + len, d, n); len += n;
+    memset(buf + len, '0', k); len += k;
+    buf[len++] = '.';
+    buf[len++] = '0';
+  } else if (point > 0) {
+    /* 1234e-2 -> 12.34 */
+    memcpy(buf + len, d, point); len += point;
+    buf[len++] = '.';
+    memcpy(buf + len, d + point, n - point); len += n - point;
+  } else {
+    /* 1234e-6 -> 0.001234 */
+    buf[len++] = '0';
+    buf[len++] = '.';
+    memset(buf + len, '0', -point); len += -point;
+    memcpy(buf + len, d, n); len += n;
+  }
+  
+  buf[len] = '\0';
+  return len;
+}
+
+/* Longer than any number prints: a sign, "0." and up to 323 zeros ahead of at most 17 digits */
+enum { LNUM_FMT_MAX = 352 };
+
+int lnum_fmt(char* buf, number n) {
+  return n.nType == typLong ? lnum_fmt_long(buf, n.value.l) : lnum_fmt_double(buf, n.value.d);
+}
+
+/* Output */
+
+/*
+** Everything printed to stdout goes through an lout,
+** which collects it in a buffer and only writes it out
+** when the buffer fills or at a flush point: after
+** each line in the REPL, at the end of a `load`, and
+** on exit. Anything else writing to stdout must flush
+** it first to keep output in order.
+**
+** An lout with no FILE writes to memory instead, and
+** its buffer grows to fit. This is how values are
+** printed into strings by `show` and string builders.
+*/
+
+enum { LOUT_SIZE = 65536 };
+
+typedef struct {
+  FILE* f;
+  char* buf;
+  size_t len;
+  size_t cap;
+} lout;
+
+static char lstdout_buf[LOUT_SIZE];
+lout lstdout = { NULL, lstdout_buf, 0, LOUT_SIZE };
+
+void lout_drain(lout* o) {
+  if (o->f == NULL) { return; }
+  fwrite(o->buf, 1, o->len, o->f);
+  o->len = 0;
+}
+
+void lout_flush(lout* o) {
+  if (o->f == NULL) { return; }
+  lout_drain(o);
+  fflush(o->f);
+}
+
+/* Make room for n more bytes, or return 0 if they can't fit */
+static int lout_room(lout* o, size_t n) {
+  if (o->len + n <= o->cap) { return 1; }
+  if (o->f) {
+    lout_drain(o);
+    return n <= o->cap;
+  }
+  size_t cap = o->cap ? o->cap : 64;
+  while (cap < o->len + n) { cap *= 2; }
+  o->buf = realloc(o->buf, cap);
+  o->cap = cap;
+  return 1;
+}
+
+void lout_write(lout* o, const char* s, size_t n) {
+  if (n == 0) { return; }
+  if (!lout_room(o, n)) { fwrite(s, 1, n, o->f); return; }
+  memcpy(o->buf + o->len, s, n);
+  o->len += n;
+}
+
+void lout_puts(lout* o, const char* s) { lout_write(o, s, strlen(s)); }
+
+void lout_putc(lout* o, char c) {
+  lout_room(o, 1);
+  o->buf[o->len++] = c;
+}
+
+void lout_num(lout* o, number n) {
+  lout_room(o, LNUM_FMT_MAX);
+  o->len += lnum_fmt(o->buf + o->len, n);
+}
+
+/* The same escapes as mpcf_escape, written without making a copy */
+static const char* lout_escapes[256] = {
+  ['\a'] = "\\a", ['\b'] = "\\b", ['\f'] = "\\f", ['\n'] = "\\n",
+  ['\r'] = "\\r", ['\t'] = "\\t", ['\v'] = "\\v", ['\\'] = "\\\\",
+  ['\''] = "\\'", ['\"'] = "\\\""
+};
+
+void lout_escape(lout* o, const char* s, size_t n) {
+  const char* run = s;
+  const char* end = s + n;
+  for (; s < end; s++) {
+    const char* esc = lout_escapes[(unsigned char)*s];
+    if (esc == NULL) { continue; }
+    lout_write(o, run, s - run);
+    lout_write(o, esc, 2);
+    run = s + 1;
+  }
+  lout_write(o, run, s - run);
+}
+
+void lval_write(lout* o, lval* v);
+void lval_write_map(lout* o, lval* v);
+void lval_write_hamt(lout* o, lval* v);
 
-void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
+void lval_write_expr(lout* o, lval* v, char open, char close) {
+  lout_putc(o, open);
   for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);    
+    lval_write(o, v->cell[i]);    
     if (i != (v->count-1)) {
-      putchar(' ');
+      lout_putc(o, ' ');
     }
   }
-  putchar(close);
+  lout_putc(o, close);
+}
+
+/* Writes out the pieces of a rope without flattening it */
+void lout_lstr(lout* o, lstr* s, int escape) {
+  if (s->kind == LSTR_CONCAT) {
+    lout_lstr(o, s->left, escape);
+    lout_lstr(o, s->right, escape);
+  } else if (escape) {
+    lout_escape(o, s->bytes, s->len);
+  } else {
+    lout_write(o, s->bytes, s->len);
+  }
 }
 
-void lval_print_str(lval* v) {
-  /* Make a Copy of the string */
-  char* escaped = malloc(strlen(v->str)+1);
-  strcpy(escaped, v->str);
-  /* Pass it through the escape function */
-  escaped = mpcf_escape(escaped);
-  /* Print it between " characters */
-  printf("\"%s\"", escaped);
-  /* free the copied string */
-  free(escaped);
+void lval_write_str(lout* o, lval* v) {
+  /* Print it escaped between " characters */
+  lout_putc(o, '"');
+  lout_lstr(o, v->str, 1);
+  lout_putc(o, '"');
 }
 
-void lval_print(lval* v) {
+void lval_write(lout* o, lval* v) {
   switch (v->type) {
     case LVAL_FUN:
       if (v->builtin) {
-        printf("<builtin>");
+        lout_puts(o, "<builtin>");
       } else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
+        lout_puts(o, v->macro ? "(macro " : "(\\ ");
+        lval_write(o, v->formals);
+        lout_putc(o, ' ');
+        lval_write(o, v->body);
+        lout_putc(o, ')');
       }
     break;
 	case LVAL_OBJ:
-		printf("Object: ");
-		lval_print(v->objSlots);
+		lout_puts(o, "Object: ");
+		lval_write(o, v->objSlots);
 	break;
-    case LVAL_NUM:
-		if(v->num.nType == typLong)
-		{
-			printf("%li", v->num.value.l);
-			break;
-		}
-			 
-		else
-		{
-			printf("%lf", v->num.value.d); break;
-		}
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_STR:   lval_print_str(v); break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+    case LVAL_NUM:   lout_num(o, v->num); break;
+    case LVAL_ERR:   lout_puts(o, "Error: "); lout_puts(o, v->err); break;
+    case LVAL_SYM:   lout_puts(o, v->sym); break;
+    case LVAL_STR:   lval_write_str(o, v); break;
+    case LVAL_BUILDER: lout_puts(o, "<builder>"); break;
+    case LVAL_MAP:   lval_write_map(o, v); break;
+    case LVAL_HAMT:  lval_write_hamt(o, v); break;
+    case LVAL_SEXPR: lval_write_expr(o, v, '(', ')'); break;
+    case LVAL_QEXPR: lval_write_expr(o, v, '{', '}'); break;
   }
 }
 
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+void lval_print(lval* v) { lval_write(&lstdout, v); }
+void lval_println(lval* v) { lval_write(&lstdout, v); lout_putc(&lstdout, '\n'); }
+
+/* Takes the contents of a memory lout as a string value */
+lval* lval_str_lout(lout* o) {
+  size_t len = o->len;
+  lout_putc(o, '\0');
+  lval* v = lval_lstr(lstr_take(realloc(o->buf, len + 1), len));
+  o->buf = NULL; o->len = 0; o->cap = 0;
+  return v;
+}
+
+/* String Builders */
+
+/*
+** A builder is a memory lout shared by every copy of
+** the value holding it, so appending through any copy
+** adds to the same buffer in place. This makes building
+** a string out of n pieces linear, rather than copying
+** the whole string again for every piece.
+*/
+
+struct lbuilder {
+  int refs;
+  lout out;
+};
+
+lval* lval_builder(void) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_BUILDER;
+  v->builder = calloc(1, sizeof(lbuilder));
+  v->builder->refs = 1;
+  return v;
+}
+
+lbuilder* lbuilder_retain(lbuilder* b) {
+  b->refs++;
+  return b;
+}
+
+void lbuilder_release(lbuilder* b) {
+  if (--b->refs > 0) { return; }
+  free(b->out.buf);
+  free(b);
+}
 
 int NUM_EQ(lval* x, lval* y){
 	if(x->num.nType == typLong && y->num.nType == typLong)
@@ -430,6 +1033,9 @@ int NUM_EQ(lval* x, lval* y){
 		return ((x->num.value.d == y->num.value.d) ? 1 : 0);		
 }
 
+int lmap_eq(lmap* x, lmap* y);
+int lhamt_eq(lhamt* x, lhamt* y);
+
 int lval_eq(lval* x, lval* y) {
   if (x->type != y->type) { return 0; }
   
@@ -437,12 +1043,16 @@ int lval_eq(lval* x, lval* y) {
     case LVAL_NUM: return ( NUM_EQ(x,y)/*x->num.value.l == y->num.value.l*/ );    
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
     case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);    
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);    
+    case LVAL_STR: return lstr_eq(x->str, y->str);
+    case LVAL_BUILDER: return x->builder == y->builder;
+    case LVAL_MAP: return lmap_eq(x->map, y->map);
+    case LVAL_HAMT: return lhamt_eq(x->hamt, y->hamt);
     case LVAL_FUN: 
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
       } else {
-        return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+        return x->macro == y->macro
+          && lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
       }    
     case LVAL_QEXPR:
     case LVAL_SEXPR:
@@ -467,117 +1077,641 @@ char* ltype_name(int t) {
     case LVAL_STR: 		return "String";
     case LVAL_SEXPR: 	return "S-Expression";
     case LVAL_QEXPR: 	return "Q-Expression";
+    case LVAL_BUILDER: 	return "Builder";
+    case LVAL_MAP: 		return "Dict";
+    case LVAL_HAMT: 	return "Persistent Dict";
     default: 			return "Unknown";
   }
 }
 
-/* Lisp Environment */
+/* Hash Maps */
 
-struct lenv {
-  lenv* par;
+/*
+** A map is an open addressing hash table with linear
+** probing, keyed by numbers, strings and symbols. Like
+** a builder it is shared by every copy of the value
+** holding it, so `put` and `del` change it in place.
+** A map put inside itself is never freed.
+**
+** Keys which are equal under lval_eq must hash the
+** same. Numbers compare by value across integers and
+** doubles, so every number is hashed as a double.
+** Deleted slots are left as tombstones until the next
+** resize so probe chains stay unbroken.
+*/
+
+typedef struct {
+  unsigned long hash;
+  lval* key;
+  lval* val;
+} lmap_slot;
+
+struct lmap {
+  int refs;
   int count;
-  char** syms;
-  lval** vals;
+  int used;
+  int cap;
+  lmap_slot* slots;
 };
 
-lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
-  e->par = NULL;
-  e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
-  return e;
+static lval lmap_tombstone;
+
+lmap* lmap_new(void) {
+  lmap* m = calloc(1, sizeof(lmap));
+  m->refs = 1;
+  return m;
 }
 
-void lenv_del(lenv* e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }  
-  free(e->syms);
-  free(e->vals);
-  free(e);
+lmap* lmap_retain(lmap* m) {
+  m->refs++;
+  return m;
 }
 
-lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
-  n->par = e->par;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
-  for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+void lmap_release(lmap* m) {
+  if (--m->refs > 0) { return; }
+  for (int i = 0; i < m->cap; i++) {
+    if (m->slots[i].key && m->slots[i].key != &lmap_tombstone) {
+      lval_del(m->slots[i].key);
+      lval_del(m->slots[i].val);
+    }
   }
-  return n;
+  free(m->slots);
+  free(m);
 }
 
-lval* lenv_get_local(lenv* e, lval* k){
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+static unsigned long lmap_mix(unsigned long long x) {
+  x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (unsigned long)x;
+}
+
+/* Hash of a key, or 0 if the value can't be one */
+unsigned long lval_hash(lval* k) {
+  unsigned long h = 0;
+  switch (k->type) {
+    case LVAL_NUM: {
+      double d = k->num.nType == typLong ? (double)k->num.value.l : k->num.value.d;
+      unsigned long long bits;
+      if (d == 0) { d = 0; }
+      memcpy(&bits, &d, sizeof(bits));
+      h = lmap_mix(bits);
+    } break;
+    case LVAL_STR: h = lmap_mix(lstr_hash(k->str)); break;
+    case LVAL_SYM: {
+      /* Mixed differently so a symbol and a string never look alike */
+      unsigned long long x = 2166136261UL;
+      for (char* s = k->sym; *s; s++) { x = (x ^ (unsigned char)*s) * 16777619UL; }
+      h = lmap_mix(x ^ 0x9e3779b97f4a7c15ULL);
+    } break;
+    default: return 0;
+  }
+  return h ? h : 1;
+}
+
+/* The slot holding k, or the free slot where it should go */
+static lmap_slot* lmap_find(lmap* m, lval* k, unsigned long h) {
+  lmap_slot* free_slot = NULL;
+  unsigned long mask = m->cap - 1;
+  for (unsigned long i = h & mask;; i = (i + 1) & mask) {
+    lmap_slot* s = &m->slots[i];
+    if (s->key == NULL) { return free_slot ? free_slot : s; }
+    if (s->key == &lmap_tombstone) {
+      if (!free_slot) { free_slot = s; }
+    } else if (s->hash == h && lval_eq(s->key, k)) {
+      return s;
     }
   }
-  return lval_err("Unbound Symbol '%s'", k->sym);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
+static void lmap_resize(lmap* m, int cap) {
+  lmap_slot* old = m->slots;
+  int old_cap = m->cap;
+  m->slots = calloc(cap, sizeof(lmap_slot));
+  m->cap = cap;
+  m->used = m->count;
+  for (int i = 0; i < old_cap; i++) {
+    if (old[i].key && old[i].key != &lmap_tombstone) {
+      *lmap_find(m, old[i].key, old[i].hash) = old[i];
+    }
+  }
+  free(old);
+}
+
+lval* lmap_get(lmap* m, lval* k, unsigned long h) {
+  if (m->count == 0) { return NULL; }
+  lmap_slot* s = lmap_find(m, k, h);
+  return s->key ? s->val : NULL;
+}
+
+/* Takes ownership of k and v */
+void lmap_put(lmap* m, lval* k, lval* v, unsigned long h) {
   
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) { return lval_copy(e->vals[i]); }
+  /* Keep at least a quarter of the slots empty */
+  if ((m->used + 1) * 4 > m->cap * 3) {
+    int cap = m->cap ? m->cap : 8;
+    while ((m->count + 1) * 2 > cap) { cap *= 2; }
+    lmap_resize(m, cap);
   }
   
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
+  lmap_slot* s = lmap_find(m, k, h);
+  if (s->key && s->key != &lmap_tombstone) {
+    lval_del(k);
+    lval_del(s->val);
+    s->val = v;
+    return;
   }
+  if (s->key == NULL) { m->used++; }
+  m->count++;
+  s->hash = h;
+  s->key = k;
+  s->val = v;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-  
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+int lmap_del(lmap* m, lval* k, unsigned long h) {
+  if (m->count == 0) { return 0; }
+  lmap_slot* s = lmap_find(m, k, h);
+  if (!s->key || s->key == &lmap_tombstone) { return 0; }
+  lval_del(s->key);
+  lval_del(s->val);
+  s->key = &lmap_tombstone;
+  s->val = NULL;
+  m->count--;
+  return 1;
+}
+
+int lmap_eq(lmap* x, lmap* y) {
+  if (x == y) { return 1; }
+  if (x->count != y->count) { return 0; }
+  for (int i = 0; i < x->cap; i++) {
+    lmap_slot* s = &x->slots[i];
+    if (!s->key || s->key == &lmap_tombstone) { continue; }
+    lval* v = lmap_get(y, s->key, s->hash);
+    if (!v || !lval_eq(s->val, v)) { return 0; }
   }
-  
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);  
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
+  return 1;
 }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-  while (e->par) { e = e->par; }
-  lenv_put(e, k, v);
+lval* lval_map(void) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_MAP;
+  v->map = lmap_new();
+  return v;
 }
 
-/* Builtins */
+void lval_write_map(lout* o, lval* v) {
+  /* Written as [k v, k v] in slot order */
+  lmap* m = v->map;
+  int first = 1;
+  lout_putc(o, '[');
+  for (int i = 0; i < m->cap; i++) {
+    lmap_slot* s = &m->slots[i];
+    if (!s->key || s->key == &lmap_tombstone) { continue; }
+    if (!first) { lout_puts(o, ", "); }
+    lval_write(o, s->key);
+    lout_putc(o, ' ');
+    lval_write(o, s->val);
+    first = 0;
+  }
+  lout_putc(o, ']');
+}
 
-#define LASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+/* Persistent Maps */
 
-#define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
-    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+/*
+** A persistent map never changes once made. `put` and
+** `del` return a new version which shares everything
+** but the path down to the changed key with the old
+** one, so an update costs O(log32 n) and copying the
+** value is just a reference count.
+**
+** It is a hash array mapped trie. Each node uses five
+** bits of the key's hash to pick one of 32 branches,
+** and only stores the branches in use, found through
+** a bitmap. A branch holds either a leaf or another
+** node. Once the hash has run out of bits, keys whose
+** hashes are the same are kept in a collision node,
+** which is just a list of leaves.
+**
+** An empty map is a NULL root.
+*/
 
-#define LASSERT_NUM(func, args, num) \
-  LASSERT(args, args->count == num, \
-    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-    func, args->count, num)
+#define LHAMT_HASH_BITS ((int)(sizeof(unsigned long) * CHAR_BIT))
 
-#define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, args->cell[index]->count != 0, \
+typedef struct {
+  int refs;
+  unsigned long hash;
+  lval* key;
+  lval* val;
+} lhamt_leaf;
+
+typedef struct {
+  lhamt_leaf* leaf;
+  lhamt* node;
+} lhamt_branch;
+
+struct lhamt {
+  int refs;
+  int size;
+  unsigned int bitmap;
+  int count;
+  lhamt_branch* branches;
+};
+
+static lhamt_leaf* lhamt_leaf_new(lval* k, lval* v, unsigned long h) {
+  lhamt_leaf* l = malloc(sizeof(lhamt_leaf));
+  l->refs = 1;
+  l->hash = h;
+  l->key = k;
+  l->val = v;
+  return l;
+}
+
+static void lhamt_leaf_release(lhamt_leaf* l) {
+  if (--l->refs > 0) { return; }
+  lval_del(l->key);
+  lval_del(l->val);
+  free(l);
+}
+
+lhamt* lhamt_retain(lhamt* n) {
+  n->refs++;
+  return n;
+}
+
+void lhamt_release(lhamt* n) {
+  if (--n->refs > 0) { return; }
+  for (int i = 0; i < n->count; i++) {
+    if (n->branches[i].leaf) { lhamt_leaf_release(n->branches[i].leaf); }
+    else { lhamt_release(n->branches[i].node); }
+  }
+  free(n->branches);
+  free(n);
+}
+
+/* A copy of n with room for `extra` more branches after `at` */
+static lhamt* lhamt_copy(lhamt* n, int at, int extra) {
+  lhamt* x = malloc(sizeof(lhamt));
+  x->refs = 1;
+  x->size = n ? n->size : 0;
+  x->bitmap = n ? n->bitmap : 0;
+  x->count = (n ? n->count : 0) + extra;
+  x->branches = malloc(sizeof(lhamt_branch) * (x->count ? x->count : 1));
+  for (int i = 0, j = 0; n && i < n->count; i++, j++) {
+    if (i == at) { j += extra; }
+    x->branches[j] = n->branches[i];
+    if (x->branches[j].leaf) { x->branches[j].leaf->refs++; }
+    else { lhamt_retain(x->branches[j].node); }
+  }
+  return x;
+}
+
+static void lhamt_branch_release(lhamt_branch b) {
+  if (b.leaf) { lhamt_leaf_release(b.leaf); } else { lhamt_release(b.node); }
+}
+
+/* Set bits in a bitmap, without relying on the CPU having a popcount instruction */
+static int lpopcount(uint32_t x) {
+#if defined(__GNUC__)
+  return __builtin_popcount(x);
+#else
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  return (int)((((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#endif
+}
+
+static int lhamt_index(lhamt* n, unsigned int bit) {
+  return lpopcount(n->bitmap & (bit - 1));
+}
+
+lval* lhamt_get(lhamt* n, lval* k, unsigned long h) {
+  for (int shift = 0; n; shift += 5) {
+    if (shift >= LHAMT_HASH_BITS) {
+      for (int i = 0; i < n->count; i++) {
+        if (lval_eq(n->branches[i].leaf->key, k)) { return n->branches[i].leaf->val; }
+      }
+      return NULL;
+    }
+    unsigned int bit = 1u << ((h >> shift) & 31);
+    if (!(n->bitmap & bit)) { return NULL; }
+    lhamt_branch* b = &n->branches[lhamt_index(n, bit)];
+    if (b->leaf) {
+      return (b->leaf->hash == h && lval_eq(b->leaf->key, k)) ? b->leaf->val : NULL;
+    }
+    n = b->node;
+  }
+  return NULL;
+}
+
+/* A new version of n with l added, taking the reference to l */
+static lhamt* lhamt_assoc(lhamt* n, lhamt_leaf* l, int shift) {
+  
+  lhamt* x;
+  if (shift >= LHAMT_HASH_BITS) {
+    for (int i = 0; n && i < n->count; i++) {
+      if (lval_eq(n->branches[i].leaf->key, l->key)) {
+        x = lhamt_copy(n, -1, 0);
+        lhamt_leaf_release(x->branches[i].leaf);
+        x->branches[i].leaf = l;
+        return x;
+      }
+    }
+    x = lhamt_copy(n, -1, 1);
+    x->branches[x->count-1] = (lhamt_branch){ l, NULL };
+    x->size++;
+    return x;
+  }
+  
+  unsigned int bit = 1u << ((l->hash >> shift) & 31);
+  int at = n ? lhamt_index(n, bit) : 0;
+  
+  /* A free branch just takes the leaf */
+  if (!n || !(n->bitmap & bit)) {
+    x = lhamt_copy(n, at, 1);
+    x->bitmap |= bit;
+    x->branches[at] = (lhamt_branch){ l, NULL };
+    x->size++;
+    return x;
+  }
+  
+  x = lhamt_copy(n, -1, 0);
+  lhamt_branch* b = &x->branches[at];
+  if (b->leaf && b->leaf->hash == l->hash && lval_eq(b->leaf->key, l->key)) {
+    lhamt_leaf_release(b->leaf);
+    b->leaf = l;
+    return x;
+  }
+  
+  /* Otherwise push both down a level */
+  lhamt* child;
+  int old_size = b->leaf ? 1 : b->node->size;
+  if (b->leaf) {
+    lhamt* one = lhamt_assoc(NULL, b->leaf, shift + 5);
+    child = lhamt_assoc(one, l, shift + 5);
+    lhamt_release(one);
+  } else {
+    child = lhamt_assoc(b->node, l, shift + 5);
+    lhamt_release(b->node);
+  }
+  x->size += child->size - old_size;
+  *b = (lhamt_branch){ NULL, child };
+  return x;
+}
+
+/* A new version of n without k, NULL if empty, or n itself if k is missing */
+static lhamt* lhamt_dissoc(lhamt* n, lval* k, unsigned long h, int shift) {
+  
+  int at = -1;
+  if (shift >= LHAMT_HASH_BITS) {
+    for (int i = 0; i < n->count; i++) {
+      if (lval_eq(n->branches[i].leaf->key, k)) { at = i; }
+    }
+  } else {
+    unsigned int bit = 1u << ((h >> shift) & 31);
+    if (!(n->bitmap & bit)) { return lhamt_retain(n); }
+    at = lhamt_index(n, bit);
+    lhamt_branch b = n->branches[at];
+    
+    /* Update a child node in place of its old version */
+    if (b.node) {
+      lhamt* child = lhamt_dissoc(b.node, k, h, shift + 5);
+      if (child == b.node) { lhamt_release(child); return lhamt_retain(n); }
+      if (child) {
+        lhamt* x = lhamt_copy(n, -1, 0);
+        lhamt_release(b.node);
+        x->size--;
+        /* A child left with a single leaf is folded back in */
+        if (child->count == 1 && child->branches[0].leaf) {
+          x->branches[at] = (lhamt_branch){ child->branches[0].leaf, NULL };
+          child->branches[0].leaf->refs++;
+          lhamt_release(child);
+        } else {
+          x->branches[at].node = child;
+        }
+        return x;
+      }
+    } else if (b.leaf->hash != h || !lval_eq(b.leaf->key, k)) {
+      at = -1;
+    }
+  }
+  
+  if (at == -1) { return lhamt_retain(n); }
+  if (n->count == 1) { return NULL; }
+  
+  /* Drop the branch at `at` */
+  lhamt* x = lhamt_copy(n, -1, 0);
+  lhamt_branch_release(x->branches[at]);
+  memmove(&x->branches[at], &x->branches[at+1],
+    sizeof(lhamt_branch) * (x->count - at - 1));
+  x->count--;
+  x->size--;
+  if (shift < LHAMT_HASH_BITS) { x->bitmap &= ~(1u << ((h >> shift) & 31)); }
+  return x;
+}
+
+typedef void (*lhamt_fn)(lhamt_leaf* l, void* data);
+
+static void lhamt_each(lhamt* n, lhamt_fn f, void* data) {
+  for (int i = 0; n && i < n->count; i++) {
+    if (n->branches[i].leaf) { f(n->branches[i].leaf, data); }
+    else { lhamt_each(n->branches[i].node, f, data); }
+  }
+}
+
+int lhamt_size(lhamt* n) { return n ? n->size : 0; }
+
+typedef struct {
+  lhamt* other;
+  int eq;
+} lhamt_eq_state;
+
+static void lhamt_eq_leaf(lhamt_leaf* l, void* data) {
+  lhamt_eq_state* s = data;
+  if (!s->eq) { return; }
+  lval* v = lhamt_get(s->other, l->key, l->hash);
+  s->eq = v && lval_eq(l->val, v);
+}
+
+int lhamt_eq(lhamt* x, lhamt* y) {
+  if (x == y) { return 1; }
+  if (lhamt_size(x) != lhamt_size(y)) { return 0; }
+  lhamt_eq_state s = { y, 1 };
+  lhamt_each(x, lhamt_eq_leaf, &s);
+  return s.eq;
+}
+
+lval* lval_hamt(lhamt* root) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_HAMT;
+  v->hamt = root;
+  return v;
+}
+
+typedef struct {
+  lout* o;
+  int first;
+} lhamt_write_state;
+
+static void lhamt_write_leaf(lhamt_leaf* l, void* data) {
+  lhamt_write_state* s = data;
+  if (!s->first) { lout_puts(s->o, ", "); }
+  lval_write(s->o, l->key);
+  lout_putc(s->o, ' ');
+  lval_write(s->o, l->val);
+  s->first = 0;
+}
+
+void lval_write_hamt(lout* o, lval* v) {
+  /* Written like a map, in hash order */
+  lhamt_write_state s = { o, 1 };
+  lout_putc(o, '[');
+  lhamt_each(v->hamt, lhamt_write_leaf, &s);
+  lout_putc(o, ']');
+}
+
+/* Lisp Environment */
+
+struct lenv {
+  lenv* par;
+  lreader* reader;
+  int count;
+  char** syms;
+  lval** vals;
+  int loop;
+};
+
+lenv* lenv_new(void) {
+  lenv* e = malloc(sizeof(lenv));
+  e->par = NULL;
+  e->reader = NULL;
+  e->count = 0;
+  e->syms = NULL;
+  e->vals = NULL;
+  e->loop = 0;
+  return e;
+}
+
+/* Frees everything in e but e itself */
+void lenv_clear(lenv* e) {
+  for (int i = 0; i < e->count; i++) {
+    free(e->syms[i]);
+    lval_del(e->vals[i]);
+  }  
+  free(e->syms);
+  free(e->vals);
+}
+
+void lenv_del(lenv* e) {
+  lenv_clear(e);
+  free(e);
+}
+
+lenv* lenv_copy(lenv* e) {
+  lenv* n = malloc(sizeof(lenv));
+  n->par = e->par;
+  n->reader = e->reader;
+  n->loop = e->loop;
+  n->count = e->count;
+  n->syms = malloc(sizeof(char*) * n->count);
+  n->vals = malloc(sizeof(lval*) * n->count);
+  for (int i = 0; i < e->count; i++) {
+    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(n->syms[i], e->syms[i]);
+    n->vals[i] = lval_copy(e->vals[i]);
+  }
+  return n;
+}
+
+/* The reader belongs to the global environment */
+lreader* lenv_reader(lenv* e) {
+  while (e->reader == NULL && e->par) { e = e->par; }
+  return e->reader;
+}
+
+lval* lenv_get_local(lenv* e, lval* k){
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) {
+      return lval_copy(e->vals[i]);
+    }
+  }
+  return lval_err("Unbound Symbol '%s'", k->sym);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+  
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) { return lval_copy(e->vals[i]); }
+  }
+  
+  if (e->par) {
+    return lenv_get(e->par, k);
+  } else {
+    return lval_err("Unbound Symbol '%s'", k->sym);
+  }
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+  
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) {
+      lval_del(e->vals[i]);
+      e->vals[i] = lval_copy(v);
+      return;
+    }
+  }
+  
+  e->count++;
+  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+  e->syms = realloc(e->syms, sizeof(char*) * e->count);  
+  e->vals[e->count-1] = lval_copy(v);
+  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
+  strcpy(e->syms[e->count-1], k->sym);
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+  while (e->par) { e = e->par; }
+  lenv_put(e, k, v);
+}
+
+/* A loop frame holds only its variable, anything else is put where the loop runs */
+void lenv_assign(lenv* e, lval* k, lval* v) {
+  while (e->loop && strcmp(e->syms[0], k->sym) != 0) { e = e->par; }
+  lenv_put(e, k, v);
+}
+
+/* Builtins */
+
+#define LASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+
+#define LASSERT_TYPE(func, args, index, expect) \
+  LASSERT(args, args->cell[index]->type == expect, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+
+#define LASSERT_NUM(func, args, num) \
+  LASSERT(args, args->count == num, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+    func, args->count, num)
+
+#define LASSERT_WHOLE(func, args, index) \
+  LASSERT_TYPE(func, args, index, LVAL_NUM); \
+  LASSERT(args, args->cell[index]->num.nType == typLong \
+    && args->cell[index]->num.value.l >= 0, \
+    "Function '%s' passed a negative or fractional number for argument %i.", \
+    func, index)
+
+#define LASSERT_NOT_EMPTY(func, args, index) \
+  LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
 
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_keep(lenv* e, lval* v);
+lval* lval_eval_body(lenv* e, lval* v);
+lval* lval_expand(lenv* e, lval* v);
+lval* lval_expand_body(lenv* e, lval* body, lval* formals);
+lval* lval_optimize_body(lenv* e, lval* body, lval* formals);
 
 lval* builtin_member(lenv* e, lval* a){
 	return lval_err("We need to do more!");
@@ -693,7 +1827,7 @@ lval* builtin_lambda(lenv* e, lval* a) {
   }
   
   lval* formals = lval_pop(a, 0);
-  lval* body = lval_pop(a, 0);
+  lval* body = lval_optimize_body(e, lval_expand_body(e, lval_pop(a, 0), formals), formals);
   lval_del(a);
   
   return lval_lambda(formals, body);
@@ -750,63 +1884,446 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
-void ADD_NUM(lval* x, lval* y){	
+/*
+** The list library works on the cell arrays of its
+** arguments directly. Lists are taken over rather
+** than copied, and elements are moved between them
+** by pointer.
+*/
 
-	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l += y->num.value.l; }
-	else if(x->num.nType == typLong && y->num.nType == typDouble) {
-		
-		x->num.value.d += y->num.value.d + x->num.value.l;
-		x->num.nType = typDouble;
-	}
-	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d += y->num.value.l;}
-	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d += y->num.value.d;}
+lval* lval_call(lenv* e, lval* f, lval* a);
+
+/* Calls f on the values in a, leaving f as it was */
+lval* lval_apply(lenv* e, lval* f, lval* a) {
+  lval* g = lval_copy(f);
+  lval* r = lval_call(e, g, a);
+  lval_del(g);
+  return r;
 }
 
-void SUB_NUM(lval* x, lval* y){	
+lval* lval_apply1(lenv* e, lval* f, lval* x) {
+  return lval_apply(e, f, lval_add(lval_sexpr(), x));
+}
 
-	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l -= y->num.value.l; }
-	else if(x->num.nType == typLong && y->num.nType == typDouble) {
-		x->num.value.d += x->num.value.l - y->num.value.d;
-		x->num.nType = typDouble;
-	}
-	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d -= y->num.value.l;}
-	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d -= y->num.value.d;}
+lval* lval_apply2(lenv* e, lval* f, lval* x, lval* y) {
+  return lval_apply(e, f, lval_add(lval_add(lval_sexpr(), x), y));
 }
 
-void MUL_NUM(lval* x, lval* y){	
+/* Deletes cells [from, to) of l */
+static void lval_del_cells(lval* l, int from, int to) {
+  for (int i = from; i < to; i++) { lval_del(l->cell[i]); }
+}
 
-	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l *= y->num.value.l; }
-	else if(x->num.nType == typLong && y->num.nType == typDouble) {
-		x->num.value.d += y->num.value.d * x->num.value.l;
-		x->num.nType = typDouble;
-	}
-	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d *= y->num.value.l;}
-	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d *= y->num.value.d;}
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_WHOLE("nth", a, 0);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->num.value.l < a->cell[1]->count,
+    "Function 'nth' passed index %li for a list of length %i.",
+    a->cell[0]->num.value.l, a->cell[1]->count);
+  
+  long i = a->cell[0]->num.value.l;
+  return lval_take(lval_take(a, 1), i);
 }
 
-void DIV_NUM(lval* x, lval* y){	
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+  
+  /* Each result goes back into the cell it came from */
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_apply1(e, f, l->cell[i]);
+    l->cell[i] = x;
+    if (x->type == LVAL_ERR) {
+      lval_del_cells(l, i+1, l->count);
+      l->count = i;
+      lval_del(a);
+      return x;
+    }
+  }
+  return lval_take(a, 1);
+}
 
-	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l /= y->num.value.l; }
-	else if(x->num.nType == typLong && y->num.nType == typDouble) {
-		x->num.value.d += x->num.value.d / y->num.value.l;
-		x->num.nType = typDouble;
-	}
-	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d /= y->num.value.l;}
-	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d /= y->num.value.d;}
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+  
+  /* Kept cells are packed down to the front of the list */
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  int kept = 0;
+  for (int i = 0; i < l->count; i++) {
+    lval* r = lval_apply1(e, f, lval_copy(l->cell[i]));
+    if (r->type != LVAL_NUM) {
+      lval* err = r->type == LVAL_ERR ? r : lval_err(
+        "Function 'filter' expected a Number from its predicate, got %s.",
+        ltype_name(r->type));
+      if (err != r) { lval_del(r); }
+      lval_del_cells(l, i, l->count);
+      l->count = kept;
+      lval_del(a);
+      return err;
+    }
+    if (r->num.value.l) { l->cell[kept++] = l->cell[i]; }
+    else { lval_del(l->cell[i]); }
+    lval_del(r);
+  }
+  l->count = kept;
+  return lval_take(a, 1);
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+lval* builtin_foldl(lenv* e, lval* a) {
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
   
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
+  /* Cells are handed to f one by one, the rest deleted on an error */
+  lval* acc = lval_pop(a, 1);
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  int i = 0;
+  while (i < l->count && acc->type != LVAL_ERR) {
+    acc = lval_apply2(e, f, acc, l->cell[i++]);
   }
+  lval_del_cells(l, i, l->count);
+  l->count = 0;
+  lval_del(a);
+  return acc;
+}
+
+lval* builtin_foldr(lenv* e, lval* a) {
+  LASSERT_NUM("foldr", a, 3);
+  LASSERT_TYPE("foldr", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldr", a, 2, LVAL_QEXPR);
   
-  lval* x = lval_pop(a, 0);
+  lval* acc = lval_pop(a, 1);
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  int i = l->count;
+  while (i > 0 && acc->type != LVAL_ERR) {
+    acc = lval_apply2(e, f, l->cell[--i], acc);
+  }
+  lval_del_cells(l, 0, i);
+  l->count = 0;
+  lval_del(a);
+  return acc;
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+  LASSERT_NUM("reverse", a, 1);
+  LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
   
-	if ((strcmp(op, "-") == 0) && a->count == 0) {
-		if(x->num.nType == typLong)
-			x->num.value.l = -x->num.value.l;
-		else
+  lval* l = lval_take(a, 0);
+  for (int i = 0, j = l->count-1; i < j; i++, j--) {
+    lval* t = l->cell[i]; l->cell[i] = l->cell[j]; l->cell[j] = t;
+  }
+  return l;
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_WHOLE("take", a, 0);
+  LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+  
+  long n = a->cell[0]->num.value.l;
+  lval* l = lval_take(a, 1);
+  if (n < l->count) {
+    lval_del_cells(l, n, l->count);
+    l->count = n;
+  }
+  return l;
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  LASSERT_NUM("drop", a, 2);
+  LASSERT_WHOLE("drop", a, 0);
+  LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+  
+  long n = a->cell[0]->num.value.l;
+  lval* l = lval_take(a, 1);
+  if (n > l->count) { n = l->count; }
+  lval_del_cells(l, 0, n);
+  memmove(&l->cell[0], &l->cell[n], sizeof(lval*) * (l->count - n));
+  l->count -= n;
+  return l;
+}
+
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'range' passed incorrect number of arguments. Got %i, Expected 1 or 2.",
+    a->count);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("range", a, i, LVAL_NUM);
+    LASSERT(a, a->cell[i]->num.nType == typLong,
+      "Function 'range' passed a fractional number for argument %i.", i);
+  }
+  
+  /* Counts from lo up to but not including hi, lo being 0 if not given */
+  long lo = a->count == 2 ? a->cell[0]->num.value.l : 0;
+  long hi = a->cell[a->count-1]->num.value.l;
+  LASSERT(a, hi - lo <= INT_MAX,
+    "Function 'range' passed a range of %li numbers, too many for a list.", hi - lo);
+  
+  lval* l = lval_qexpr();
+  if (hi > lo) {
+    l->cell = malloc(sizeof(lval*) * (hi - lo));
+    for (long i = lo; i < hi; i++) {
+      l->cell[l->count++] = lval_num((number){ typLong, { .l = i } });
+    }
+  }
+  lval_del(a);
+  return l;
+}
+
+lval* builtin_zip(lenv* e, lval* a) {
+  int n = INT_MAX;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("zip", a, i, LVAL_QEXPR);
+    if (a->cell[i]->count < n) { n = a->cell[i]->count; }
+  }
+  
+  /* The i-th list holds the i-th item of each, stopping at the shortest */
+  lval* z = lval_qexpr();
+  z->cell = malloc(sizeof(lval*) * (n ? n : 1));
+  for (int i = 0; i < n; i++) {
+    lval* t = lval_qexpr();
+    t->cell = malloc(sizeof(lval*) * a->count);
+    for (int j = 0; j < a->count; j++) {
+      t->cell[t->count++] = a->cell[j]->cell[i];
+      a->cell[j]->cell[i] = NULL;
+    }
+    z->cell[z->count++] = t;
+  }
+  for (int j = 0; j < a->count; j++) {
+    lval_del_cells(a->cell[j], n, a->cell[j]->count);
+    a->cell[j]->count = 0;
+  }
+  lval_del(a);
+  return z;
+}
+
+/*
+** `sort` orders a list in place. Lists made only of
+** integers, or only of doubles, are sorted by an LSD
+** radix sort on their bits: eight passes of a byte
+** each, skipping any pass where every key has the
+** same byte. Anything else goes through a stable
+** merge sort, ordering numbers by value and strings
+** and symbols by their bytes, or using the function
+** given, which should return true when its first
+** argument belongs before its second.
+*/
+
+typedef struct {
+  uint64_t key;
+  lval* v;
+} lsort_item;
+
+/* Maps each number to a key whose unsigned order is the number's order */
+static uint64_t lsort_key(lval* v) {
+  uint64_t bits;
+  if (v->num.nType == typLong) {
+    bits = (uint64_t)v->num.value.l;
+    return bits ^ (1ULL << 63);
+  }
+  memcpy(&bits, &v->num.value.d, sizeof(bits));
+  return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+static void lsort_radix(lval** cells, int n) {
+  
+  lsort_item* a = malloc(sizeof(lsort_item) * n);
+  lsort_item* b = malloc(sizeof(lsort_item) * n);
+  for (int i = 0; i < n; i++) { a[i].key = lsort_key(cells[i]); a[i].v = cells[i]; }
+  
+  for (int shift = 0; shift < 64; shift += 8) {
+    
+    size_t counts[256] = {0};
+    for (int i = 0; i < n; i++) { counts[(a[i].key >> shift) & 0xFF]++; }
+    if (counts[(a[0].key >> shift) & 0xFF] == (size_t)n) { continue; }
+    
+    size_t total = 0;
+    for (int i = 0; i < 256; i++) {
+      size_t c = counts[i]; counts[i] = total; total += c;
+    }
+    for (int i = 0; i < n; i++) { b[counts[(a[i].key >> shift) & 0xFF]++] = a[i]; }
+    lsort_item* t = a; a = b; b = t;
+  }
+  
+  for (int i = 0; i < n; i++) { cells[i] = a[i].v; }
+  free(a); free(b);
+}
+
+typedef struct {
+  lenv* e;
+  lval* f;
+  lval* err;
+} lsort_ctx;
+
+static int lsort_cmp(lval* x, lval* y) {
+  switch (x->type) {
+    case LVAL_NUM: {
+      double dx = x->num.nType == typLong ? x->num.value.l : x->num.value.d;
+      double dy = y->num.nType == typLong ? y->num.value.l : y->num.value.d;
+      if (x->num.nType == typLong && y->num.nType == typLong) {
+        return (x->num.value.l > y->num.value.l) - (x->num.value.l < y->num.value.l);
+      }
+      return (dx > dy) - (dx < dy);
+    }
+    case LVAL_STR: {
+      size_t n = x->str->len < y->str->len ? x->str->len : y->str->len;
+      int r = memcmp(lstr_data(x->str), lstr_data(y->str), n);
+      if (r) { return r; }
+      return (x->str->len > y->str->len) - (x->str->len < y->str->len);
+    }
+    case LVAL_SYM: return strcmp(x->sym, y->sym);
+  }
+  return 0;
+}
+
+/* Once the function has failed everything compares equal to finish quickly */
+static int lsort_less(lsort_ctx* c, lval* x, lval* y) {
+  if (c->err) { return 0; }
+  if (!c->f) { return lsort_cmp(x, y) < 0; }
+  
+  lval* r = lval_apply2(c->e, c->f, lval_copy(x), lval_copy(y));
+  if (r->type == LVAL_NUM) {
+    int less = r->num.value.l != 0;
+    lval_del(r);
+    return less;
+  }
+  c->err = r->type == LVAL_ERR ? r : lval_err(
+    "Function 'sort' expected a Number from its comparison, got %s.",
+    ltype_name(r->type));
+  if (c->err != r) { lval_del(r); }
+  return 0;
+}
+
+static void lsort_merge(lsort_ctx* c, lval** v, lval** tmp, int n) {
+  
+  /* Short runs are insertion sorted */
+  if (n <= 12) {
+    for (int i = 1; i < n; i++) {
+      lval* x = v[i];
+      int j = i;
+      while (j > 0 && lsort_less(c, x, v[j-1])) { v[j] = v[j-1]; j--; }
+      v[j] = x;
+    }
+    return;
+  }
+  
+  int m = n / 2;
+  lsort_merge(c, v, tmp, m);
+  lsort_merge(c, v + m, tmp, n - m);
+  if (!lsort_less(c, v[m], v[m-1])) { return; }
+  
+  memcpy(tmp, v, sizeof(lval*) * m);
+  int i = 0, j = m, k = 0;
+  while (i < m && j < n) {
+    v[k++] = lsort_less(c, v[j], tmp[i]) ? v[j++] : tmp[i++];
+  }
+  while (i < m) { v[k++] = tmp[i++]; }
+}
+
+lval* builtin_sort(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'sort' passed incorrect number of arguments. Got %i, Expected 1 or 2.",
+    a->count);
+  if (a->count == 2) { LASSERT_TYPE("sort", a, 0, LVAL_FUN); }
+  LASSERT_TYPE("sort", a, a->count-1, LVAL_QEXPR);
+  
+  lsort_ctx c = { e, a->count == 2 ? a->cell[0] : NULL, NULL };
+  lval* l = a->cell[a->count-1];
+  if (l->count < 2) { return lval_take(a, a->count-1); }
+  
+  /* Without a function every item must be of one type we can order */
+  int longs = 0, doubles = 0;
+  if (!c.f) {
+    int t = l->cell[0]->type;
+    for (int i = 0; i < l->count; i++) {
+      lval* x = l->cell[i];
+      LASSERT(a, x->type == t && (t == LVAL_NUM || t == LVAL_STR || t == LVAL_SYM),
+        "Function 'sort' can only order lists of Numbers, Strings or Symbols. Got %s at %i.",
+        ltype_name(x->type), i);
+      if (t == LVAL_NUM) {
+        if (x->num.nType == typLong) { longs++; } else { doubles++; }
+      }
+    }
+  }
+  
+  if (longs == l->count || doubles == l->count) {
+    lsort_radix(l->cell, l->count);
+  } else {
+    lval** tmp = malloc(sizeof(lval*) * (l->count / 2 + 1));
+    lsort_merge(&c, l->cell, tmp, l->count);
+    free(tmp);
+  }
+  
+  if (c.err) { lval_del(a); return c.err; }
+  return lval_take(a, a->count-1);
+}
+
+void ADD_NUM(lval* x, lval* y){	
+
+	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l += y->num.value.l; }
+	else if(x->num.nType == typLong && y->num.nType == typDouble) {
+		
+		x->num.value.d += y->num.value.d + x->num.value.l;
+		x->num.nType = typDouble;
+	}
+	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d += y->num.value.l;}
+	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d += y->num.value.d;}
+}
+
+void SUB_NUM(lval* x, lval* y){	
+
+	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l -= y->num.value.l; }
+	else if(x->num.nType == typLong && y->num.nType == typDouble) {
+		x->num.value.d += x->num.value.l - y->num.value.d;
+		x->num.nType = typDouble;
+	}
+	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d -= y->num.value.l;}
+	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d -= y->num.value.d;}
+}
+
+void MUL_NUM(lval* x, lval* y){	
+
+	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l *= y->num.value.l; }
+	else if(x->num.nType == typLong && y->num.nType == typDouble) {
+		x->num.value.d += y->num.value.d * x->num.value.l;
+		x->num.nType = typDouble;
+	}
+	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d *= y->num.value.l;}
+	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d *= y->num.value.d;}
+}
+
+void DIV_NUM(lval* x, lval* y){	
+
+	if(x->num.nType == typLong && y->num.nType == typLong) {x->num.value.l /= y->num.value.l; }
+	else if(x->num.nType == typLong && y->num.nType == typDouble) {
+		x->num.value.d += x->num.value.d / y->num.value.l;
+		x->num.nType = typDouble;
+	}
+	else if(x->num.nType == typDouble && y->num.nType == typLong) {x->num.value.d /= y->num.value.l;}
+	else if(x->num.nType == typDouble && y->num.nType == typDouble) {x->num.value.d /= y->num.value.d;}
+}
+
+lval* builtin_op(lenv* e, lval* a, char* op) {
+  
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE(op, a, i, LVAL_NUM);
+  }
+  
+  lval* x = lval_pop(a, 0);
+  
+	if ((strcmp(op, "-") == 0) && a->count == 0) {
+		if(x->num.nType == typLong)
+			x->num.value.l = -x->num.value.l;
+		else
 			x->num.value.d = -x->num.value.d;
 	}
   
@@ -836,34 +2353,58 @@ lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
 lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
 lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-  
-  lval* syms = a->cell[0];
+/* Binds each of syms to the matching one of the n vals, copying them */
+static lval* lenv_bind(lenv* e, lval* syms, lval** vals, int n, char* func) {
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-      "Function '%s' cannot define non-symbol. "
-      "Got %s, Expected %s.",
-      func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+    if (syms->cell[i]->type != LVAL_SYM) {
+      return lval_err("Function '%s' cannot define non-symbol. "
+        "Got %s, Expected %s.",
+        func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+    }
   }
   
-  LASSERT(a, (syms->count == a->count-1),
-    "Function '%s' passed too many arguments for symbols. "
-    "Got %i, Expected %i.",
-    func, syms->count, a->count-1);
+  if (syms->count != n) {
+    return lval_err("Function '%s' passed too many arguments for symbols. "
+      "Got %i, Expected %i.", func, syms->count, n);
+  }
     
   for (int i = 0; i < syms->count; i++) {
-    if (strcmp(func, "def") == 0) { lenv_def(e, syms->cell[i], a->cell[i+1]); }
-    if (strcmp(func, "=")   == 0) { lenv_put(e, syms->cell[i], a->cell[i+1]); } 
+    if (strcmp(func, "def") == 0) { lenv_def(e, syms->cell[i], vals[i]); }
+    if (strcmp(func, "=")   == 0) { lenv_assign(e, syms->cell[i], vals[i]); } 
   }
-  
-  lval_del(a);
   return lval_sexpr();
 }
 
+lval* builtin_var(lenv* e, lval* a, char* func) {
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  lval* r = lenv_bind(e, a->cell[0], a->cell+1, a->count-1, func);
+  lval_del(a);
+  return r;
+}
+
 lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
 lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
 
+lval* special_var(lenv* e, lval* form, char* func) {
+  if (form->cell[1]->type != LVAL_QEXPR) { return NULL; }
+  
+  /* Every value is evaluated before the first error is given, as for a call */
+  lval* vals = lval_sexpr();
+  for (int i = 2; i < form->count; i++) {
+    lval_add(vals, lval_eval_keep(e, form->cell[i]));
+  }
+  for (int i = 0; i < vals->count; i++) {
+    if (vals->cell[i]->type == LVAL_ERR) { return lval_take(vals, i); }
+  }
+  
+  lval* r = lenv_bind(e, form->cell[1], vals->cell, vals->count, func);
+  lval_del(vals);
+  return r;
+}
+
+lval* special_def(lenv* e, lval* form) { return special_var(e, form, "def"); }
+lval* special_put(lenv* e, lval* form) { return special_var(e, form, "="); }
+
 number GREATER(lval* a, number r){
 	if(a->cell[0]->num.nType == typLong && a->cell[1]->num.nType == typLong)
 		r.value.l = (a->cell[0]->num.value.l >  a->cell[1]->num.value.l);
@@ -962,123 +2503,1661 @@ lval* builtin_if(lenv* e, lval* a) {
   } else {
     x = lval_eval(e, lval_pop(a, 2));
   }
-  
-  lval_del(a);
-  return x;
+  
+  lval_del(a);
+  return x;
+}
+
+/* Whether items from..n-1 of v are all written as Q-Expressions */
+static int lval_quoted_from(lval* v, int from) {
+  for (int i = from; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_QEXPR) { return 0; }
+  }
+  return 1;
+}
+
+lval* special_if(lenv* e, lval* form) {
+  if (form->count != 4 || !lval_quoted_from(form, 2)) { return NULL; }
+  
+  lval* c = lval_eval_keep(e, form->cell[1]);
+  if (c->type != LVAL_NUM) {
+    lval* err = c->type == LVAL_ERR ? c : lval_err(
+      "Function 'if' passed incorrect type for argument 0. Got %s, Expected %s.",
+      ltype_name(c->type), ltype_name(LVAL_NUM));
+    if (err != c) { lval_del(c); }
+    return err;
+  }
+  
+  int hit = c->num.value.l != 0;
+  lval_del(c);
+  return lval_eval_body(e, form->cell[hit ? 2 : 3]);
+}
+
+/*
+** `and`, `or`, `cond` and `case` only evaluate what
+** they need to. Like the branches of `if`, anything
+** which might not be evaluated is passed quoted:
+** operands of `and`/`or` as Q-Expressions, and the
+** clauses of `cond`/`case` as Q-Expressions holding
+** a test or key followed by a result. The symbol
+** `else` in place of a test or key always matches.
+*/
+
+static int lval_is_else(lval* v) {
+  return v->type == LVAL_SYM && strcmp(v->sym, "else") == 0;
+}
+
+/* Stops at the first of the n operands equal to stop_on and returns it */
+static lval* llogic(lenv* e, lval** ops, int n, char* func, int stop_on) {
+  lval* r = lval_num((number){ typLong, { .l = !stop_on } });
+  for (int i = 0; i < n; i++) {
+    lval_del(r);
+    r = ops[i]->type == LVAL_QEXPR ? lval_eval_body(e, ops[i]) : lval_copy(ops[i]);
+    if (r->type == LVAL_ERR) { break; }
+    if (r->type != LVAL_NUM) {
+      lval* err = lval_err("Function '%s' expected Numbers, got %s.",
+        func, ltype_name(r->type));
+      lval_del(r);
+      r = err;
+      break;
+    }
+    if ((r->num.value.l != 0) == stop_on) { break; }
+  }
+  return r;
+}
+
+lval* builtin_logic(lenv* e, lval* a, char* func, int stop_on) {
+  lval* r = llogic(e, a->cell, a->count, func, stop_on);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, "and", 0); }
+lval* builtin_or(lenv* e, lval* a) { return builtin_logic(e, a, "or", 1); }
+
+lval* special_logic(lenv* e, lval* form, char* func, int stop_on) {
+  if (!lval_quoted_from(form, 1)) { return NULL; }
+  return llogic(e, form->cell+1, form->count-1, func, stop_on);
+}
+
+lval* special_and(lenv* e, lval* form) { return special_logic(e, form, "and", 0); }
+lval* special_or(lenv* e, lval* form) { return special_logic(e, form, "or", 1); }
+
+#define LASSERT_CLAUSES(func, args, from, shape) \
+  for (int i = from; i < args->count; i++) { \
+    LASSERT(args, args->cell[i]->type == LVAL_QEXPR && args->cell[i]->count == 2, \
+      "Function '%s' expected clauses like %s, got %s at %i.", \
+      func, shape, ltype_name(args->cell[i]->type), i); \
+  }
+
+/* Whether items from..n-1 of v are all written as clauses */
+static int lval_clauses_from(lval* v, int from) {
+  for (int i = from; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_QEXPR || v->cell[i]->count != 2) { return 0; }
+  }
+  return 1;
+}
+
+static lval* lcond(lenv* e, lval** clauses, int n) {
+  for (int i = 0; i < n; i++) {
+    lval* clause = clauses[i];
+    if (!lval_is_else(clause->cell[0])) {
+      lval* t = lval_eval_keep(e, clause->cell[0]);
+      if (t->type != LVAL_NUM) {
+        lval* err = t->type == LVAL_ERR ? t : lval_err(
+          "Function 'cond' expected a Number from test %i, got %s.",
+          i, ltype_name(t->type));
+        if (err != t) { lval_del(t); }
+        return err;
+      }
+      int hit = t->num.value.l != 0;
+      lval_del(t);
+      if (!hit) { continue; }
+    }
+    return lval_eval_keep(e, clause->cell[1]);
+  }
+  return lval_sexpr();
+}
+
+lval* builtin_cond(lenv* e, lval* a) {
+  LASSERT_CLAUSES("cond", a, 0, "{test result}");
+  lval* r = lcond(e, a->cell, a->count);
+  lval_del(a);
+  return r;
+}
+
+lval* special_cond(lenv* e, lval* form) {
+  if (!lval_clauses_from(form, 1)) { return NULL; }
+  return lcond(e, form->cell+1, form->count-1);
+}
+
+/*
+** The keys of `case` are compared as they are written,
+** never evaluated. A clause may list several keys in
+** a Q-Expression. A form evaluated in place keeps a
+** table from each of its keys to the first clause
+** listing it, built the first time it runs, so finding
+** the clause is one lookup however many there are.
+** Copies of a lambda share its body, so a `case` in
+** a function keeps its table from one call to the
+** next. Forms with a key which can't be hashed, and the
+** fresh arguments of a call to the builtin, are
+** scanned clause by clause instead.
+*/
+
+struct lcases {
+  lval** cell;
+  int count;
+  lmap* keys;
+  int other;
+};
+
+void lcases_del(lcases* t) {
+  if (t->keys) { lmap_release(t->keys); }
+  free(t);
+}
+static int lcase_match(lval* key, lval* v) {
+  if (lval_is_else(key)) { return 1; }
+  if (key->type == LVAL_QEXPR) {
+    for (int i = 0; i < key->count; i++) {
+      if (lval_eq(key->cell[i], v)) { return 1; }
+    }
+    return 0;
+  }
+  return lval_eq(key, v);
+}
+
+static lval* lcase(lenv* e, lval* v, lval** clauses, int n) {
+  for (int i = 0; i < n; i++) {
+    if (lcase_match(clauses[i]->cell[0], v)) {
+      return lval_eval_keep(e, clauses[i]->cell[1]);
+    }
+  }
+  return lval_sexpr();
+}
+
+lval* builtin_case(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1,
+    "Function 'case' passed no arguments.");
+  LASSERT_CLAUSES("case", a, 1, "{key result}");
+  lval* r = lcase(e, a->cell[0], a->cell+1, a->count-1);
+  lval_del(a);
+  return r;
+}
+
+/* Maps each key to the first clause listing it, or gives NULL if a key can't be hashed */
+static lmap* lcase_keys(lval** clauses, int n) {
+  lmap* m = lmap_new();
+  for (int i = 0; i < n; i++) {
+    lval* key = clauses[i]->cell[0];
+    if (lval_is_else(key)) { continue; }
+    int many = key->type == LVAL_QEXPR;
+    for (int j = 0; j < (many ? key->count : 1); j++) {
+      lval* k = many ? key->cell[j] : key;
+      unsigned long h = lval_hash(k);
+      if (h == 0) {
+        lmap_release(m);
+        return NULL;
+      }
+      if (!lmap_get(m, k, h)) {
+        lmap_put(m, lval_copy(k), lval_num((number){ typLong, { .l = i } }), h);
+      }
+    }
+  }
+  return m;
+}
+
+/* The form's table, made again if the form has been resized since */
+static lcases* lcase_table(lval* form) {
+  lcases* t = form->cases;
+  if (t && t->cell == form->cell && t->count == form->count) { return t; }
+  if (t) { lcases_del(t); }
+  
+  t = malloc(sizeof(lcases));
+  t->cell = form->cell;
+  t->count = form->count;
+  t->keys = lcase_keys(form->cell+2, form->count-2);
+  t->other = form->count-2;
+  for (int i = 2; i < form->count; i++) {
+    if (lval_is_else(form->cell[i]->cell[0])) { t->other = i-2; break; }
+  }
+  form->cases = t;
+  return t;
+}
+
+lval* special_case(lenv* e, lval* form) {
+  if (!lval_clauses_from(form, 2)) { return NULL; }
+  lval* v = lval_eval_keep(e, form->cell[1]);
+  if (v->type == LVAL_ERR) { return v; }
+  
+  lcases* t = lcase_table(form);
+  lval* r;
+  if (t->keys) {
+    /* An else clause before the matching one wins, as it would in a scan */
+    unsigned long h = lval_hash(v);
+    lval* hit = h ? lmap_get(t->keys, v, h) : NULL;
+    int i = hit && hit->num.value.l < t->other ? (int)hit->num.value.l : t->other;
+    r = i < form->count-2 ? lval_eval_keep(e, form->cell[2+i]->cell[1]) : lval_sexpr();
+  } else {
+    r = lcase(e, v, form->cell+2, form->count-2);
+  }
+  lval_del(v);
+  return r;
+}
+
+/*
+** Loops run their body in the current environment
+** rather than calling a function for each iteration.
+** Bodies are passed as Q-Expressions, like the
+** branches of `if`, and are evaluated in place with
+** lval_eval_body, so nothing is copied per step. The
+** loop variable is bound once, in a frame on the C
+** stack whose parent is the current environment, and
+** its value updated in its slot. Like `let`, the frame
+** is cleared when the loop ends, so a variable of the
+** same name outside the loop is left untouched. Other
+** names given with `=` pass through the frame to the
+** environment the loop runs in.
+*/
+
+/* Binds k in e if it isn't already, and gives its slot */
+int lenv_slot(lenv* e, lval* k) {
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) { return i; }
+  }
+  lval* empty = lval_sexpr();
+  lenv_put(e, k, empty);
+  lval_del(empty);
+  return e->count-1;
+}
+
+/* Gives the slot a new value, taking ownership of it */
+static void lenv_set_slot(lenv* e, int i, lval* v) {
+  lval_del(e->vals[i]);
+  e->vals[i] = v;
+}
+
+#define LASSERT_LOOP_VAR(func, args, index) \
+  LASSERT_TYPE(func, args, index, LVAL_QEXPR); \
+  LASSERT(args, args->cell[index]->count == 1 \
+    && args->cell[index]->cell[0]->type == LVAL_SYM, \
+    "Function '%s' expected a single symbol in {} for argument %i.", func, index)
+
+/* Whether v is written as a loop variable like {i} */
+static int lval_loop_var(lval* v) {
+  return v->type == LVAL_QEXPR && v->count == 1 && v->cell[0]->type == LVAL_SYM;
+}
+
+static lval* lloop_while(lenv* e, lval* cond, lval* body) {
+  while (1) {
+    lval* c = lval_eval_body(e, cond);
+    if (c->type != LVAL_NUM) {
+      lval* err = c->type == LVAL_ERR ? c : lval_err(
+        "Function 'while' expected a Number from its condition, got %s.",
+        ltype_name(c->type));
+      if (err != c) { lval_del(c); }
+      return err;
+    }
+    int go = c->num.value.l != 0;
+    lval_del(c);
+    if (!go) { break; }
+    
+    lval* r = lval_eval_body(e, body);
+    if (r->type == LVAL_ERR) { return r; }
+    lval_del(r);
+  }
+  return lval_sexpr();
+}
+
+lval* builtin_while(lenv* e, lval* a) {
+  LASSERT_NUM("while", a, 2);
+  LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+  lval* r = lloop_while(e, a->cell[0], a->cell[1]);
+  lval_del(a);
+  return r;
+}
+
+lval* special_while(lenv* e, lval* form) {
+  if (form->count != 3 || !lval_quoted_from(form, 1)) { return NULL; }
+  return lloop_while(e, form->cell[1], form->cell[2]);
+}
+
+static lval* lloop_dotimes(lenv* e, lval* var, long n, lval* body) {
+  lenv frame = { e, NULL, 0, NULL, NULL, 1 };
+  int slot = lenv_slot(&frame, var);
+  
+  /* Counts from 0 up to but not including n */
+  for (long i = 0; i < n; i++) {
+    lenv_set_slot(&frame, slot, lval_num((number){ typLong, { .l = i } }));
+    lval* r = lval_eval_body(&frame, body);
+    if (r->type == LVAL_ERR) {
+      lenv_clear(&frame);
+      return r;
+    }
+    lval_del(r);
+  }
+  lenv_clear(&frame);
+  return lval_sexpr();
+}
+
+lval* builtin_dotimes(lenv* e, lval* a) {
+  LASSERT_NUM("dotimes", a, 3);
+  LASSERT_LOOP_VAR("dotimes", a, 0);
+  LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+  LASSERT(a, a->cell[1]->num.nType == typLong,
+    "Function 'dotimes' passed a fractional number for argument 1.");
+  LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+  lval* r = lloop_dotimes(e, a->cell[0]->cell[0], a->cell[1]->num.value.l, a->cell[2]);
+  lval_del(a);
+  return r;
+}
+
+lval* special_dotimes(lenv* e, lval* form) {
+  if (form->count != 4 || !lval_loop_var(form->cell[1])
+    || form->cell[3]->type != LVAL_QEXPR) { return NULL; }
+  
+  lval* n = lval_eval_keep(e, form->cell[2]);
+  if (n->type != LVAL_NUM || n->num.nType != typLong) {
+    lval* err = n->type == LVAL_ERR ? n : n->type != LVAL_NUM ? lval_err(
+      "Function 'dotimes' passed incorrect type for argument 1. Got %s, Expected %s.",
+      ltype_name(n->type), ltype_name(LVAL_NUM)) : lval_err(
+      "Function 'dotimes' passed a fractional number for argument 1.");
+    if (err != n) { lval_del(n); }
+    return err;
+  }
+  
+  lval* r = lloop_dotimes(e, form->cell[1]->cell[0], n->num.value.l, form->cell[3]);
+  lval_del(n);
+  return r;
+}
+
+/* Each item is moved out of l into the slot rather than copied, leaving l empty */
+static lval* lloop_for_each(lenv* e, lval* var, lval* l, lval* body) {
+  lenv frame = { e, NULL, 0, NULL, NULL, 1 };
+  int slot = lenv_slot(&frame, var);
+  
+  for (int i = 0; i < l->count; i++) {
+    lenv_set_slot(&frame, slot, l->cell[i]);
+    l->cell[i] = NULL;
+    lval* r = lval_eval_body(&frame, body);
+    if (r->type == LVAL_ERR) {
+      lval_del_cells(l, i+1, l->count);
+      l->count = 0;
+      lenv_clear(&frame);
+      return r;
+    }
+    lval_del(r);
+  }
+  l->count = 0;
+  lenv_clear(&frame);
+  return lval_sexpr();
+}
+
+lval* builtin_for_each(lenv* e, lval* a) {
+  LASSERT_NUM("for-each", a, 3);
+  LASSERT_LOOP_VAR("for-each", a, 0);
+  LASSERT_TYPE("for-each", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("for-each", a, 2, LVAL_QEXPR);
+  lval* r = lloop_for_each(e, a->cell[0]->cell[0], a->cell[1], a->cell[2]);
+  lval_del(a);
+  return r;
+}
+
+lval* special_for_each(lenv* e, lval* form) {
+  if (form->count != 4 || !lval_loop_var(form->cell[1])
+    || form->cell[3]->type != LVAL_QEXPR) { return NULL; }
+  
+  lval* l = lval_eval_keep(e, form->cell[2]);
+  if (l->type != LVAL_QEXPR) {
+    lval* err = l->type == LVAL_ERR ? l : lval_err(
+      "Function 'for-each' passed incorrect type for argument 1. Got %s, Expected %s.",
+      ltype_name(l->type), ltype_name(LVAL_QEXPR));
+    if (err != l) { lval_del(l); }
+    return err;
+  }
+  
+  lval* r = lloop_for_each(e, form->cell[1]->cell[0], l, form->cell[3]);
+  lval_del(l);
+  return r;
+}
+
+/*
+** `let` and `let*` bind their variables in a frame
+** which lives on the C stack for as long as the body
+** is being evaluated. Its slots are sized up front to
+** the number of bindings and given the values as they
+** are evaluated, so no function is made or called.
+** With `let` every value is evaluated in the outer
+** environment, with `let*` each one can see those
+** bound before it.
+*/
+
+/* Whether b is written as a binding like {name value} */
+static int lval_binding(lval* b) {
+  return (b->type == LVAL_QEXPR || b->type == LVAL_SEXPR)
+    && b->count == 2 && b->cell[0]->type == LVAL_SYM;
+}
+
+static lval* llet(lenv* e, lval* binds, lval* body, int sequential) {
+  int slots = binds->count > 0 ? binds->count : 1;
+  lenv frame = { e, NULL, 0, NULL, NULL, 0 };
+  frame.syms = malloc(sizeof(char*) * slots);
+  frame.vals = malloc(sizeof(lval*) * slots);
+  
+  for (int i = 0; i < binds->count; i++) {
+    lval* b = binds->cell[i];
+    int count = frame.count;
+    lval* v = lval_eval_keep(sequential ? &frame : e, b->cell[1]);
+    
+    /* Anything put in the frame meanwhile resized it to fit exactly */
+    if (frame.count != count) {
+      slots = frame.count + binds->count - i;
+      frame.syms = realloc(frame.syms, sizeof(char*) * slots);
+      frame.vals = realloc(frame.vals, sizeof(lval*) * slots);
+    }
+    
+    if (v->type == LVAL_ERR) {
+      lenv_clear(&frame);
+      return v;
+    }
+    
+    /* Names bound twice keep the later value */
+    int slot = frame.count;
+    for (int j = 0; j < frame.count; j++) {
+      if (strcmp(frame.syms[j], b->cell[0]->sym) == 0) { slot = j; }
+    }
+    if (slot < frame.count) {
+      lval_del(frame.vals[slot]);
+    } else {
+      frame.syms[slot] = malloc(strlen(b->cell[0]->sym) + 1);
+      strcpy(frame.syms[slot], b->cell[0]->sym);
+      frame.count++;
+    }
+    frame.vals[slot] = v;
+  }
+  
+  lval* r = lval_eval_body(&frame, body);
+  lenv_clear(&frame);
+  return r;
+}
+
+lval* builtin_let_frame(lenv* e, lval* a, char* func, int sequential) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+  
+  lval* binds = a->cell[0];
+  for (int i = 0; i < binds->count; i++) {
+    LASSERT(a, lval_binding(binds->cell[i]),
+      "Function '%s' expected bindings like {name value}, got %s at %i.",
+      func, ltype_name(binds->cell[i]->type), i);
+  }
+  
+  lval* r = llet(e, binds, a->cell[1], sequential);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_let(lenv* e, lval* a) { return builtin_let_frame(e, a, "let", 0); }
+lval* builtin_let_star(lenv* e, lval* a) { return builtin_let_frame(e, a, "let*", 1); }
+
+lval* special_let_frame(lenv* e, lval* form, int sequential) {
+  if (form->count != 3 || !lval_quoted_from(form, 1)) { return NULL; }
+  lval* binds = form->cell[1];
+  for (int i = 0; i < binds->count; i++) {
+    if (!lval_binding(binds->cell[i])) { return NULL; }
+  }
+  return llet(e, binds, form->cell[2], sequential);
+}
+
+lval* special_let(lenv* e, lval* form) { return special_let_frame(e, form, 0); }
+lval* special_let_star(lenv* e, lval* form) { return special_let_frame(e, form, 1); }
+
+/*
+** A macro is a function given the expressions of
+** its arguments, unevaluated, which returns the code
+** to run in their place. Forms are expanded as they
+** are loaded, and lambda bodies as the lambda is
+** made, so the macro runs once and the lambda keeps
+** the expanded code. Expansion replaces calls in
+** parentheses and looks into the Q-Expressions which
+** are code: the body of a lambda or macro and those
+** given to `if`, loops, `and`, `or` and `let`, taken
+** as calls, and the values bound by `let` and results
+** of `cond` and `case` clauses. Other Q-Expressions
+** may be data, like the `{(unless 1 2)}` given to
+** `def`, and are left as written. A parameter of the
+** lambda, or a loop or `let` variable around the call,
+** never stands for a macro. Calls to macros in other
+** Q-Expressions, or defined after the form was loaded,
+** are expanded each time they are evaluated instead.
+**
+** `form` builds an S-Expression from its arguments,
+** so a macro can put one call inside another.
+*/
+
+#define LEXPAND_DEPTH_MAX 256
+
+/* Number of macros defined, while there are none expansion does nothing */
+static int lmacros_num = 0;
+
+/* Finds the value bound to k without copying it, or NULL */
+lval* lenv_find(lenv* e, lval* k) {
+  for (; e; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) { return e->vals[i]; }
+    }
+  }
+  return NULL;
+}
+
+/*
+** The names bound around the code being looked at,
+** one scope for each lambda, loop or `let` it is
+** inside: the lambda's parameters, the loop's variable
+** or the bindings of the `let`. Any of them hides a
+** global of the same name.
+*/
+typedef struct lscope {
+  lval* names;
+  struct lscope* par;
+} lscope;
+
+/*
+** Finds the value k names in the global environment,
+** or NULL if a name in s or a binding in any frame
+** between e and the global one hides it. Those frames
+** are gone or changed by the time the code runs, so
+** only global names are worth trusting.
+*/
+static lval* lcode_find(lenv* e, lval* k, lscope* s) {
+  if (k->type != LVAL_SYM) { return NULL; }
+  for (; s; s = s->par) {
+    for (int i = 0; i < s->names->count; i++) {
+      lval* n = s->names->cell[i];
+      if (lval_binding(n)) { n = n->cell[0]; }
+      if (n->type == LVAL_SYM && strcmp(n->sym, k->sym) == 0) { return NULL; }
+    }
+  }
+  for (; e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) { return NULL; }
+    }
+  }
+  return lenv_find(e, k);
+}
+
+/* Gives the builtin that k names globally, unless something nearer hides it */
+static lbuiltin lcode_builtin(lenv* e, lval* k, lscope* s) {
+  lval* f = lcode_find(e, k, s);
+  return f && f->type == LVAL_FUN ? f->builtin : NULL;
+}
+
+/* Whether item i of a call to f with n items is a body of code */
+static int lcode_body_arg(lbuiltin f, int i, int n) {
+  if (f == builtin_if) { return i >= 2; }
+  if (f == builtin_while || f == builtin_and || f == builtin_or) { return i >= 1; }
+  if (f == builtin_dotimes || f == builtin_for_each) { return i == n-1; }
+  if (f == builtin_let || f == builtin_let_star) { return i == 2; }
+  return 0;
+}
+
+enum { LCODE_PAIR = 1, LCODE_PAIRS };
+
+/*
+** Whether item i of a call to f holds code in pairs,
+** either as a clause of `cond` or `case` or as the list
+** of bindings of a `let`, setting from to the first
+** item of each pair which is code.
+*/
+static int lcode_pairs_arg(lbuiltin f, int i, int* from) {
+  if (f == builtin_let || f == builtin_let_star) { *from = 1; return i == 1 ? LCODE_PAIRS : 0; }
+  if (f == builtin_cond) { *from = 0; return i >= 1 ? LCODE_PAIR : 0; }
+  if (f == builtin_case) { *from = 1; return i >= 2 ? LCODE_PAIR : 0; }
+  return 0;
+}
+
+/* Whether v is a pair in such a list */
+static int lcode_pair(lval* v) {
+  return (v->type == LVAL_QEXPR || v->type == LVAL_SEXPR) && v->count == 2;
+}
+
+/* The names v, a call to f, binds around its bodies, or NULL */
+static lval* lcode_names(lbuiltin f, lval* v) {
+  if ((f == builtin_dotimes || f == builtin_for_each)
+    && v->count > 1 && lval_loop_var(v->cell[1])) { return v->cell[1]; }
+  if ((f == builtin_let || f == builtin_let_star)
+    && v->count > 1 && v->cell[1]->type == LVAL_QEXPR) { return v->cell[1]; }
+  return NULL;
+}
+
+/* Calls the macro m on copies of the items of v after its head, giving the code it expands to */
+lval* lval_macro_expand(lenv* e, lval* m, lval* v) {
+  
+  int total = m->formals->count;
+  for (int i = 0; i < m->formals->count; i++) {
+    if (strcmp(m->formals->cell[i]->sym, "&") == 0) { total = i; break; }
+  }
+  if (v->count-1 < total) {
+    return lval_err("Macro passed too few arguments. "
+      "Got %i, Expected %i.", v->count-1, total);
+  }
+  
+  lval* args = lval_sexpr();
+  for (int i = 1; i < v->count; i++) { lval_add(args, lval_copy(v->cell[i])); }
+  lval* x = lval_apply(e, m, args);
+  if (x->type == LVAL_QEXPR) { x->type = LVAL_SEXPR; }
+  return x;
+}
+
+static lval* lexpand_body(lenv* e, lval* body, lscope* s, int depth);
+
+/* Expands v, an S-Expression or, if call is set, a Q-Expression run as one */
+static lval* lexpand(lenv* e, lval* v, lscope* s, int depth, int call) {
+  if (v->type != LVAL_SEXPR && !(call && v->type == LVAL_QEXPR)) { return v; }
+  if (v->count == 0) { return v; }
+  
+  lval* f = v->cell[0];
+  if (f->type == LVAL_SYM) { f = lcode_find(e, f, s); }
+  if (v->count > 1 && f && f->type == LVAL_FUN && f->macro) {
+    if (depth >= LEXPAND_DEPTH_MAX) {
+      lval_del(v);
+      return lval_err("Macro expansion went deeper than %i.", LEXPAND_DEPTH_MAX);
+    }
+    lval* x = lval_macro_expand(e, f, v);
+    lval_del(v);
+    return lexpand(e, x, s, depth+1, 0);
+  }
+  
+  lbuiltin b = f && f->type == LVAL_FUN ? f->builtin : NULL;
+  lscope inner = { lcode_names(b, v), s };
+  lscope* t = inner.names ? &inner : s;
+  int from, kind;
+  for (int i = 0; i < v->count; i++) {
+    lval* c = v->cell[i];
+    if (c->type == LVAL_SEXPR) {
+      v->cell[i] = lexpand(e, c, s, depth, 0);
+    } else if (c->type == LVAL_QEXPR && lcode_body_arg(b, i, v->count)) {
+      v->cell[i] = lexpand_body(e, c, t, depth);
+    } else if (c->type == LVAL_QEXPR && (kind = lcode_pairs_arg(b, i, &from))) {
+      lval** p = kind == LCODE_PAIRS ? c->cell : &v->cell[i];
+      int n = kind == LCODE_PAIRS ? c->count : 1;
+      for (int j = 0; j < n; j++) {
+        if (!lcode_pair(p[j])) { continue; }
+        for (int k = from; k < 2; k++) {
+          p[j]->cell[k] = lexpand(e, p[j]->cell[k], t, depth, 0);
+        }
+      }
+    }
+  }
+  return v;
+}
+
+static lval* lexpand_body(lenv* e, lval* body, lscope* s, int depth) {
+  lval* x = lexpand(e, body, s, depth, 1);
+  if (x->type == LVAL_SEXPR) { x->type = LVAL_QEXPR; return x; }
+  if (x->type == LVAL_QEXPR) { return x; }
+  return lval_add(lval_qexpr(), x);
+}
+
+/* Expands the macro calls in a form being loaded, in place */
+lval* lval_expand(lenv* e, lval* v) {
+  if (lmacros_num == 0) { return v; }
+  return lexpand(e, v, NULL, 0, 0);
+}
+
+/* Expands the Q-Expression body of a function with the given formals, which is itself a call */
+lval* lval_expand_body(lenv* e, lval* body, lval* formals) {
+  if (lmacros_num == 0) { return body; }
+  lscope s = { formals, NULL };
+  return lexpand_body(e, body, &s, 0);
+}
+
+lval* builtin_form(lenv* e, lval* a) {
+  return a;
+}
+
+/*
+** Lambda bodies are simplified once, as the lambda
+** is made, and so are forms as they are loaded. A
+** call to a pure builtin on constant arguments, like
+** `(* 60 60 24)`, is replaced by its result, and an
+** `if` on a constant condition by the branch it takes.
+** Q-Expressions are only looked into where they are
+** code, the same places macros are expanded. Only
+** global names are looked up, as the code is being
+** simplified. A name which is a parameter, a `let` or
+** loop variable, or put in a function's environment
+** with `=` is never folded,
+** but this counts on the global builtins it folds not
+** being rebound afterwards. `--no-opt` turns it off.
+*/
+
+static int lopt_enabled = 1;
+
+static int lopt_const(lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_STR;
+}
+
+static int lopt_pure(lbuiltin f) {
+  return f == builtin_add || f == builtin_sub || f == builtin_mul || f == builtin_div
+    || f == builtin_eq || f == builtin_ne || f == builtin_gt || f == builtin_lt
+    || f == builtin_ge || f == builtin_le;
+}
+
+static lval* lopt_body(lenv* e, lval* body, lscope* s);
+
+/* Simplifies v, an S-Expression or, if call is set, a Q-Expression run as one */
+static lval* lopt(lenv* e, lval* v, lscope* s, int call) {
+  if (v->type != LVAL_SEXPR && !(call && v->type == LVAL_QEXPR)) { return v; }
+  if (v->count == 0) { return v; }
+  
+  lbuiltin f = lcode_builtin(e, v->cell[0], s);
+  lscope inner = { lcode_names(f, v), s };
+  lscope* t = inner.names ? &inner : s;
+  int from, kind;
+  for (int i = 0; i < v->count; i++) {
+    lval* c = v->cell[i];
+    if (c->type == LVAL_SEXPR) {
+      v->cell[i] = lopt(e, c, s, 0);
+    } else if (c->type == LVAL_QEXPR && lcode_body_arg(f, i, v->count)) {
+      v->cell[i] = lopt_body(e, c, t);
+    } else if (c->type == LVAL_QEXPR && (kind = lcode_pairs_arg(f, i, &from))) {
+      lval** p = kind == LCODE_PAIRS ? c->cell : &v->cell[i];
+      int n = kind == LCODE_PAIRS ? c->count : 1;
+      for (int j = 0; j < n; j++) {
+        if (!lcode_pair(p[j])) { continue; }
+        for (int k = from; k < 2; k++) {
+          p[j]->cell[k] = lopt(e, p[j]->cell[k], t, 0);
+        }
+      }
+    }
+  }
+  
+  /* Only the branch an if on a constant takes is kept */
+  if (f == builtin_if && v->count == 4 && v->cell[1]->type == LVAL_NUM
+    && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR) {
+    lval* b = lval_pop(v, v->cell[1]->num.value.l ? 2 : 3);
+    lval_del(v);
+    b->type = LVAL_SEXPR;
+    if (b->count == 1 && lopt_const(b->cell[0])) { return lval_take(b, 0); }
+    return b;
+  }
+  
+  /* Pure calls on constants are run now, unless they fail */
+  if (lopt_pure(f) && v->count > 1) {
+    for (int i = 1; i < v->count; i++) {
+      if (!lopt_const(v->cell[i])) { return v; }
+    }
+    lval* r = lval_eval_body(e, v);
+    if (r->type == LVAL_ERR) { lval_del(r); return v; }
+    lval_del(v);
+    return r;
+  }
+  
+  return v;
+}
+
+static lval* lopt_body(lenv* e, lval* body, lscope* s) {
+  lval* x = lopt(e, body, s, 1);
+  if (x->type == LVAL_SEXPR) { x->type = LVAL_QEXPR; return x; }
+  if (x->type == LVAL_QEXPR) { return x; }
+  return lval_add(lval_qexpr(), x);
+}
+
+/* Simplifies a form being loaded */
+lval* lval_optimize(lenv* e, lval* v) {
+  return lopt_enabled ? lopt(e, v, NULL, 0) : v;
+}
+
+/* Simplifies the Q-Expression body of a lambda with the given formals */
+lval* lval_optimize_body(lenv* e, lval* body, lval* formals) {
+  if (!lopt_enabled) { return body; }
+  lscope s = { formals, NULL };
+  return lopt_body(e, body, &s);
+}
+
+lval* builtin_defmacro(lenv* e, lval* a) {
+  LASSERT_NUM("defmacro", a, 2);
+  LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("defmacro", a, 0);
+  
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+      "Cannot define non-symbol. Got %s, Expected %s.",
+      ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+  
+  lval* formals = lval_pop(a, 0);
+  lval* name = lval_pop(formals, 0);
+  lval* m = lval_lambda(formals, lval_expand_body(e, lval_pop(a, 0), formals));
+  m->macro = 1;
+  lmacros_num++;
+  
+  lenv_def(e, name, m);
+  lval_del(name); lval_del(m); lval_del(a);
+  return lval_sexpr();
+}
+
+lval* lval_read_file(lreader* r, char* filename);
+void lval_eval_each(lenv* e, lval* expr);
+
+lval* builtin_load(lenv* e, lval* a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+  
+  lreader* r = lenv_reader(e);
+  LASSERT(a, r != NULL, "Function 'load' has no reader to parse with.");
+  
+  /* Parse File given by string name */
+  lval* expr = lval_read_file(r, lstr_cstr(a->cell[0]->str));
+  lval_del(a);
+  if (expr->type == LVAL_ERR) { return expr; }
+  
+  /* Evaluate each Expression */
+  lval_eval_each(e, expr);
+  
+  /* Return empty list */
+  return lval_sexpr();
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+  
+  /* Print each argument followed by a space */
+  for (int i = 0; i < a->count; i++) {
+    lval_write(&lstdout, a->cell[i]); lout_putc(&lstdout, ' ');
+  }
+  
+  /* Print a newline and delete arguments */
+  lout_putc(&lstdout, '\n');
+  lval_del(a);
+  
+  return lval_sexpr();
+}
+
+lval* builtin_show(lenv* e, lval* a) {
+  LASSERT_NUM("show", a, 1);
+  
+  /* Print into memory exactly as `print` would to stdout */
+  lout o = { NULL, NULL, 0, 0 };
+  lval_write(&o, a->cell[0]);
+  
+  lval_del(a);
+  return lval_str_lout(&o);
+}
+
+/* Strings are added as they are, anything else as it would print */
+void lbuilder_append(lbuilder* b, lval* a, int from) {
+  for (int i = from; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_STR) {
+      lout_lstr(&b->out, a->cell[i]->str, 0);
+    } else {
+      lval_write(&b->out, a->cell[i]);
+    }
+  }
+}
+
+lval* builtin_builder(lenv* e, lval* a) {
+  /* Calls always need an argument, so take the first pieces here */
+  lval* v = lval_builder();
+  lbuilder_append(v->builder, a, 0);
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_append(lenv* e, lval* a) {
+  LASSERT_TYPE("append", a, 0, LVAL_BUILDER);
+  lbuilder_append(a->cell[0]->builder, a, 1);
+  
+  /* Return the builder so appends can be chained */
+  return lval_take(a, 0);
+}
+
+lval* builtin_finish(lenv* e, lval* a) {
+  LASSERT_NUM("finish", a, 1);
+  LASSERT_TYPE("finish", a, 0, LVAL_BUILDER);
+  
+  /* Copy out the contents, the builder can carry on being used */
+  lout* o = &a->cell[0]->builder->out;
+  lval* v = lval_lstr(lstr_new(o->buf ? o->buf : "", o->len));
+  
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_concat(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("concat", a, i, LVAL_STR);
+  }
+  
+  /* Join the strings as a rope, sharing all their bytes */
+  lstr* s = lstr_retain(a->cell[0]->str);
+  for (int i = 1; i < a->count; i++) {
+    s = lstr_concat(s, lstr_retain(a->cell[i]->str));
+  }
+  
+  lval_del(a);
+  return lval_lstr(s);
+}
+
+lval* builtin_substr(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'substr' passed incorrect number of arguments. Got %i, Expected 2 or 3.",
+    a->count);
+  LASSERT_TYPE("substr", a, 0, LVAL_STR);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_WHOLE("substr", a, i);
+  }
+  
+  /* Starting at start, run to the end unless a length is given */
+  size_t size = a->cell[0]->str->len;
+  size_t start = a->cell[1]->num.value.l;
+  LASSERT(a, start <= size,
+    "Function 'substr' passed start %li past the end of a string of length %li.",
+    (long)start, (long)size);
+  size_t len = size - start;
+  if (a->count == 3 && (size_t)a->cell[2]->num.value.l < len) {
+    len = a->cell[2]->num.value.l;
+  }
+  
+  lstr* s = lstr_slice(lstr_retain(a->cell[0]->str), start, len);
+  lval_del(a);
+  return lval_lstr(s);
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  
+  number n = { typLong, { .l = 0 } };
+  switch (a->cell[0]->type) {
+    case LVAL_STR:   n.value.l = a->cell[0]->str->len; break;
+    case LVAL_QEXPR: n.value.l = a->cell[0]->count; break;
+    case LVAL_MAP:   n.value.l = a->cell[0]->map->count; break;
+    case LVAL_HAMT:  n.value.l = lhamt_size(a->cell[0]->hamt); break;
+    default:
+      LASSERT(a, 0,
+        "Function 'len' passed incorrect type for argument 0. Got %s, Expected %s, %s or %s.",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_STR), ltype_name(LVAL_QEXPR),
+        ltype_name(LVAL_MAP));
+  }
+  
+  lval_del(a);
+  return lval_num(n);
+}
+
+#define LASSERT_KEY(func, args, index) \
+  LASSERT(args, lval_hash(args->cell[index]) != 0, \
+    "Function '%s' passed %s as a key. Expected %s, %s or %s.", \
+    func, ltype_name(args->cell[index]->type), \
+    ltype_name(LVAL_NUM), ltype_name(LVAL_STR), ltype_name(LVAL_SYM))
+
+#define LASSERT_MAP(func, args, index) \
+  LASSERT(args, args->cell[index]->type == LVAL_MAP \
+    || args->cell[index]->type == LVAL_HAMT, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_MAP))
+
+lval* builtin_dict(lenv* e, lval* a) {
+  LASSERT_NUM("dict", a, 1);
+  LASSERT_TYPE("dict", a, 0, LVAL_QEXPR);
+  
+  /* Built from a list of keys each followed by its value */
+  lval* l = a->cell[0];
+  LASSERT(a, l->count % 2 == 0,
+    "Function 'dict' passed a list of %i items. Expected keys and values in pairs.",
+    l->count);
+  for (int i = 0; i < l->count; i += 2) {
+    LASSERT_KEY("dict", l, i);
+  }
+  
+  lval* v = lval_map();
+  for (int i = 0; i < l->count; i += 2) {
+    lmap_put(v->map, lval_copy(l->cell[i]), lval_copy(l->cell[i+1]),
+      lval_hash(l->cell[i]));
+  }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_pdict(lenv* e, lval* a) {
+  LASSERT_NUM("pdict", a, 1);
+  LASSERT_TYPE("pdict", a, 0, LVAL_QEXPR);
+  
+  lval* l = a->cell[0];
+  LASSERT(a, l->count % 2 == 0,
+    "Function 'pdict' passed a list of %i items. Expected keys and values in pairs.",
+    l->count);
+  for (int i = 0; i < l->count; i += 2) {
+    LASSERT_KEY("pdict", l, i);
+  }
+  
+  /* Each version is only held here, so the old one is dropped right away */
+  lhamt* root = NULL;
+  for (int i = 0; i < l->count; i += 2) {
+    lhamt* next = lhamt_assoc(root, lhamt_leaf_new(lval_copy(l->cell[i]),
+      lval_copy(l->cell[i+1]), lval_hash(l->cell[i])), 0);
+    if (root) { lhamt_release(root); }
+    root = next;
+  }
+  lval_del(a);
+  return lval_hamt(root);
+}
+
+lval* builtin_get(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'get' passed incorrect number of arguments. Got %i, Expected 2 or 3.",
+    a->count);
+  LASSERT_MAP("get", a, 0);
+  LASSERT_KEY("get", a, 1);
+  
+  /* Missing keys give the default if there is one */
+  unsigned long h = lval_hash(a->cell[1]);
+  lval* v = a->cell[0]->type == LVAL_MAP
+    ? lmap_get(a->cell[0]->map, a->cell[1], h)
+    : lhamt_get(a->cell[0]->hamt, a->cell[1], h);
+  if (v) {
+    v = lval_copy(v);
+  } else if (a->count == 3) {
+    v = lval_pop(a, 2);
+  } else {
+    v = lval_err("Key not found in map.");
+  }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_mput(lenv* e, lval* a) {
+  LASSERT_NUM("put", a, 3);
+  LASSERT_MAP("put", a, 0);
+  LASSERT_KEY("put", a, 1);
+  
+  unsigned long h = lval_hash(a->cell[1]);
+  lval* v = lval_pop(a, 2);
+  lval* k = lval_pop(a, 1);
+  lval* m = lval_take(a, 0);
+  if (m->type == LVAL_MAP) {
+    lmap_put(m->map, k, v, h);
+    return m;
+  }
+  
+  /* Persistent maps give back a new version instead */
+  lhamt* root = lhamt_assoc(m->hamt, lhamt_leaf_new(k, v, h), 0);
+  lval_del(m);
+  return lval_hamt(root);
+}
+
+lval* builtin_mdel(lenv* e, lval* a) {
+  LASSERT_NUM("del", a, 2);
+  LASSERT_MAP("del", a, 0);
+  LASSERT_KEY("del", a, 1);
+  
+  unsigned long h = lval_hash(a->cell[1]);
+  if (a->cell[0]->type == LVAL_MAP) {
+    lmap_del(a->cell[0]->map, a->cell[1], h);
+    return lval_take(a, 0);
+  }
+  
+  lhamt* root = a->cell[0]->hamt;
+  root = root ? lhamt_dissoc(root, a->cell[1], h, 0) : NULL;
+  lval_del(a);
+  return lval_hamt(root);
+}
+
+static void lhamt_add_key(lhamt_leaf* l, void* data) {
+  lval* v = data;
+  v->cell[v->count++] = lval_copy(l->key);
+}
+
+lval* builtin_keys(lenv* e, lval* a) {
+  LASSERT_NUM("keys", a, 1);
+  LASSERT_MAP("keys", a, 0);
+  
+  lval* v = lval_qexpr();
+  if (a->cell[0]->type == LVAL_HAMT) {
+    v->cell = malloc(sizeof(lval*) * lhamt_size(a->cell[0]->hamt));
+    lhamt_each(a->cell[0]->hamt, lhamt_add_key, v);
+    lval_del(a);
+    return v;
+  }
+  
+  lmap* m = a->cell[0]->map;
+  v->cell = malloc(sizeof(lval*) * m->count);
+  for (int i = 0; i < m->cap; i++) {
+    lmap_slot* s = &m->slots[i];
+    if (!s->key || s->key == &lmap_tombstone) { continue; }
+    v->cell[v->count++] = lval_copy(s->key);
+  }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+  
+  /* Construct Error from first argument */
+  lval* err = lval_err(lstr_cstr(a->cell[0]->str));
+  
+  /* Delete arguments and return */
+  lval_del(a);
+  return err;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+/* Builtin Table */
+
+/*
+** Every builtin is listed here once. Its position
+** in the table is its id, which is what gets written
+** to heap images in place of the function pointer.
+** An image also saves the name of every id, and
+** builtins are matched to them by name as it loads,
+** so entries can be added, moved or removed freely,
+** but renaming one breaks images which use it. Builtins
+** which are also special forms give both functions:
+** the special form for when they head an expression
+** and the builtin for when they are applied to values.
+*/
+
+typedef struct {
+  char* name;
+  lbuiltin func;
+  lspecial special;
+} lbuiltin_entry;
+
+static const lbuiltin_entry lbuiltins[] = {
+  /* Variable Functions */
+  { "\\",       builtin_lambda   },
+  { "obj",      builtin_object   }, // OBJECT IN THE MAKING
+  { "instance", builtin_instance }, // INSTANCE IN THE MAKING
+  { "->",       builtin_member   },
+  { "def",      builtin_def, special_def },
+  { "=",        builtin_put, special_put },
+  
+  /* List Functions */
+  { "list", builtin_list },
+  { "head", builtin_head },
+  { "tail", builtin_tail },
+  { "eval", builtin_eval },
+  { "join", builtin_join },
+  
+  /* Mathematical Functions */
+  { "+", builtin_add },
+  { "-", builtin_sub },
+  { "*", builtin_mul },
+  { "/", builtin_div },
+  
+  /* Comparison Functions */
+  { "if", builtin_if, special_if },
+  { "==", builtin_eq },
+  { "!=", builtin_ne },
+  { ">",  builtin_gt },
+  { "<",  builtin_lt },
+  { ">=", builtin_ge },
+  { "<=", builtin_le },
+  
+  /* String Functions */
+  { "load",  builtin_load  },
+  { "error", builtin_error },
+  { "print", builtin_print },
+  { "show",    builtin_show    },
+  { "builder", builtin_builder },
+  { "append",  builtin_append  },
+  { "finish",  builtin_finish  },
+  { "concat",  builtin_concat  },
+  { "substr",  builtin_substr  },
+  { "len",     builtin_len     },
+  
+  /* Map Functions */
+  { "dict",  builtin_dict  },
+  { "pdict", builtin_pdict },
+  { "get",   builtin_get   },
+  { "put",   builtin_mput  },
+  { "del",   builtin_mdel  },
+  { "keys",  builtin_keys  },
+  
+  /* List Library */
+  { "nth",     builtin_nth     },
+  { "map",     builtin_map     },
+  { "filter",  builtin_filter  },
+  { "foldl",   builtin_foldl   },
+  { "foldr",   builtin_foldr   },
+  { "reverse", builtin_reverse },
+  { "take",    builtin_take    },
+  { "drop",    builtin_drop    },
+  { "range",   builtin_range   },
+  { "zip",     builtin_zip     },
+  { "sort",    builtin_sort    },
+  
+  /* Loops */
+  { "while",    builtin_while,    special_while    },
+  { "dotimes",  builtin_dotimes,  special_dotimes  },
+  { "for-each", builtin_for_each, special_for_each },
+  
+  /* Local Variables */
+  { "let",  builtin_let,      special_let      },
+  { "let*", builtin_let_star, special_let_star },
+  
+  /* Conditionals */
+  { "and",  builtin_and,  special_and  },
+  { "or",   builtin_or,   special_or   },
+  { "cond", builtin_cond, special_cond },
+  { "case", builtin_case, special_case },
+  
+  /* Macros */
+  { "defmacro", builtin_defmacro },
+  { "form",     builtin_form     },
+};
+
+#define LBUILTINS_NUM ((int)(sizeof(lbuiltins) / sizeof(lbuiltins[0])))
+
+int lbuiltin_id(lbuiltin func) {
+  for (int i = 0; i < LBUILTINS_NUM; i++) {
+    if (lbuiltins[i].func == func) { return i; }
+  }
+  return -1;
+}
+
+lspecial lbuiltin_special(lbuiltin func) {
+  int id = lbuiltin_id(func);
+  return id < 0 ? NULL : lbuiltins[id].special;
+}
+
+void lenv_add_builtins(lenv* e) {
+  for (int i = 0; i < LBUILTINS_NUM; i++) {
+    lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+  }
+}
+
+/* Heap Images */
+
+/*
+** An image is the global environment written out
+** after builtins and any prelude files have been
+** loaded, so a later launch can skip straight to
+** evaluating its own input.
+**
+** Layout, all integers little-endian:
+**
+**   "ALTLISPI" u32:version
+**   u32:builtins  { u32:len bytes:name }*
+**   lenv
+**
+**   lenv : u32:count { u32:len bytes:sym  lval }*
+**   lval : u8:type ...
+**
+** Builtins are written as an index into the name
+** table in the header. On restore each name is
+** looked up in `lbuiltins`, so the only fixup
+** needed is one table lookup per builtin name.
+*/
+
+#define LIMAGE_MAGIC   "ALTLISPI"
+#define LIMAGE_VERSION 2
+
+typedef struct {
+  FILE* f;
+  int failed;
+  lbuiltin* funcs;
+  int funcs_num;
+} limage;
+
+static void limage_write_u8(limage* m, unsigned char x) {
+  if (fputc(x, m->f) == EOF) { m->failed = 1; }
+}
+
+static void limage_write_u32(limage* m, unsigned long x) {
+  for (int i = 0; i < 4; i++) { limage_write_u8(m, (x >> (8 * i)) & 0xFF); }
+}
+
+static void limage_write_u64(limage* m, unsigned long long x) {
+  for (int i = 0; i < 8; i++) { limage_write_u8(m, (x >> (8 * i)) & 0xFF); }
+}
+
+static void limage_write_str(limage* m, char* s) {
+  size_t len = strlen(s);
+  limage_write_u32(m, len);
+  if (fwrite(s, 1, len, m->f) != len) { m->failed = 1; }
+}
+
+static unsigned char limage_read_u8(limage* m) {
+  int c = fgetc(m->f);
+  if (c == EOF) { m->failed = 1; return 0; }
+  return c;
+}
+
+static unsigned long limage_read_u32(limage* m) {
+  unsigned long x = 0;
+  for (int i = 0; i < 4; i++) { x |= (unsigned long)limage_read_u8(m) << (8 * i); }
+  return x;
+}
+
+static unsigned long long limage_read_u64(limage* m) {
+  unsigned long long x = 0;
+  for (int i = 0; i < 8; i++) { x |= (unsigned long long)limage_read_u8(m) << (8 * i); }
+  return x;
+}
+
+static char* limage_read_str(limage* m) {
+  unsigned long len = limage_read_u32(m);
+  if (m->failed || len > (1UL << 30)) { m->failed = 1; return NULL; }
+  char* s = malloc(len + 1);
+  if (fread(s, 1, len, m->f) != len) { m->failed = 1; }
+  s[len] = '\0';
+  return s;
+}
+
+static void limage_write_lenv(limage* m, lenv* e);
+
+static void limage_write_lval(limage* m, lval* v);
+
+static void limage_write_leaf(lhamt_leaf* l, void* data) {
+  limage_write_lval(data, l->key);
+  limage_write_lval(data, l->val);
+}
+
+static void limage_write_lval(limage* m, lval* v) {
+  
+  limage_write_u8(m, v->type);
+  
+  switch (v->type) {
+    case LVAL_NUM:
+      limage_write_u8(m, v->num.nType);
+      if (v->num.nType == typLong) {
+        limage_write_u64(m, (unsigned long long)v->num.value.l);
+      } else {
+        unsigned long long bits;
+        memcpy(&bits, &v->num.value.d, sizeof(bits));
+        limage_write_u64(m, bits);
+      }
+    break;
+    case LVAL_ERR: limage_write_str(m, v->err); break;
+    case LVAL_SYM: limage_write_str(m, v->sym); break;
+    case LVAL_STR: limage_write_str(m, lstr_cstr(v->str)); break;
+    case LVAL_BUILDER:
+      /* Written like a string, copies sharing it are restored apart */
+      limage_write_u32(m, v->builder->out.len);
+      if (fwrite(v->builder->out.buf, 1, v->builder->out.len, m->f) != v->builder->out.len) {
+        m->failed = 1;
+      }
+    break;
+    case LVAL_MAP:
+      limage_write_u32(m, v->map->count);
+      for (int i = 0; i < v->map->cap; i++) {
+        lmap_slot* s = &v->map->slots[i];
+        if (!s->key || s->key == &lmap_tombstone) { continue; }
+        limage_write_lval(m, s->key);
+        limage_write_lval(m, s->val);
+      }
+    break;
+    case LVAL_HAMT:
+      limage_write_u32(m, lhamt_size(v->hamt));
+      lhamt_each(v->hamt, limage_write_leaf, m);
+    break;
+    case LVAL_FUN:
+      if (v->builtin) {
+        limage_write_u8(m, 1);
+        limage_write_u32(m, lbuiltin_id(v->builtin));
+      } else {
+        limage_write_u8(m, v->macro ? 2 : 0);
+        limage_write_lenv(m, v->env);
+        limage_write_lval(m, v->formals);
+        limage_write_lval(m, v->body);
+      }
+    break;
+    case LVAL_OBJ:
+      /* Objects backed by a C function have no stable id */
+      if (v->objBuiltin) { m->failed = 1; break; }
+      limage_write_lenv(m, v->objEnv);
+      limage_write_lval(m, v->objSlots);
+    break;
+    case LVAL_INST:
+      limage_write_str(m, v->name);
+      limage_write_lenv(m, v->instEnv);
+      limage_write_lval(m, v->memberVariables);
+    break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      limage_write_u32(m, v->count);
+      for (int i = 0; i < v->count; i++) {
+        limage_write_lval(m, v->cell[i]);
+      }
+    break;
+  }
+}
+
+static void limage_write_lenv(limage* m, lenv* e) {
+  limage_write_u32(m, e->count);
+  for (int i = 0; i < e->count; i++) {
+    limage_write_str(m, e->syms[i]);
+    limage_write_lval(m, e->vals[i]);
+  }
 }
 
-lval* lval_read(mpc_ast_t* t);
+static lenv* limage_read_lenv(limage* m);
 
-lval* builtin_load(lenv* e, lval* a) {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
+static lval* limage_read_lval(limage* m) {
   
-  /* Parse File given by string name */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-    
-    /* Read contents */
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
+  lval* v = malloc(sizeof(lval));
+  v->type = limage_read_u8(m);
+  v->cases = NULL;
+  
+  switch (v->type) {
+    case LVAL_NUM:
+      v->num.nType = limage_read_u8(m) == typLong ? typLong : typDouble;
+      if (v->num.nType == typLong) {
+        v->num.value.l = (long)limage_read_u64(m);
+      } else {
+        unsigned long long bits = limage_read_u64(m);
+        memcpy(&v->num.value.d, &bits, sizeof(bits));
+      }
+    break;
+    case LVAL_ERR: v->err = limage_read_str(m); break;
+    case LVAL_SYM: v->sym = limage_read_str(m); break;
+    case LVAL_STR: {
+      char* s = limage_read_str(m);
+      v->str = s ? lstr_take(s, strlen(s)) : NULL;
+    } break;
+    case LVAL_BUILDER: {
+      char* s = limage_read_str(m);
+      v->builder = calloc(1, sizeof(lbuilder));
+      v->builder->refs = 1;
+      if (s) {
+        v->builder->out.buf = s;
+        v->builder->out.len = strlen(s);
+        v->builder->out.cap = v->builder->out.len + 1;
+      }
+    } break;
+    case LVAL_MAP: {
+      v->map = lmap_new();
+      unsigned long count = limage_read_u32(m);
+      if (m->failed || count > (1UL << 28)) { m->failed = 1; break; }
+      for (unsigned long i = 0; i < count && !m->failed; i++) {
+        lval* k = limage_read_lval(m);
+        lval* x = limage_read_lval(m);
+        unsigned long h = lval_hash(k);
+        if (h == 0) { m->failed = 1; lval_del(k); lval_del(x); break; }
+        lmap_put(v->map, k, x, h);
+      }
+    } break;
+    case LVAL_HAMT: {
+      v->hamt = NULL;
+      unsigned long count = limage_read_u32(m);
+      if (m->failed || count > (1UL << 28)) { m->failed = 1; break; }
+      for (unsigned long i = 0; i < count && !m->failed; i++) {
+        lval* k = limage_read_lval(m);
+        lval* x = limage_read_lval(m);
+        unsigned long h = lval_hash(k);
+        if (h == 0) { m->failed = 1; lval_del(k); lval_del(x); break; }
+        lhamt* next = lhamt_assoc(v->hamt, lhamt_leaf_new(k, x, h), 0);
+        if (v->hamt) { lhamt_release(v->hamt); }
+        v->hamt = next;
+      }
+    } break;
+    case LVAL_FUN: {
+      int kind = limage_read_u8(m);
+      v->macro = kind == 2;
+      if (v->macro) { lmacros_num++; }
+      if (kind == 1) {
+        unsigned long id = limage_read_u32(m);
+        if (id >= (unsigned long)m->funcs_num || !m->funcs[id]) {
+          m->failed = 1;
+          v->builtin = builtin_error;
+        } else {
+          v->builtin = m->funcs[id];
+        }
+        v->special = lbuiltin_special(v->builtin);
+      } else {
+        v->builtin = NULL;
+        v->special = NULL;
+        v->env = limage_read_lenv(m);
+        v->formals = limage_read_lval(m);
+        v->body = limage_read_lval(m);
+        v->body->refs = 1;
+      }
+    } break;
+    case LVAL_OBJ:
+      v->objBuiltin = NULL;
+      v->objEnv = limage_read_lenv(m);
+      v->objSlots = limage_read_lval(m);
+    break;
+    case LVAL_INST:
+      v->name = limage_read_str(m);
+      v->instEnv = limage_read_lenv(m);
+      v->memberVariables = limage_read_lval(m);
+    break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      v->count = 0;
+      v->cell = NULL;
+      unsigned long count = limage_read_u32(m);
+      if (m->failed || count > (1UL << 28)) { m->failed = 1; break; }
+      v->cell = malloc(sizeof(lval*) * count);
+      for (unsigned long i = 0; i < count; i++) {
+        v->cell[v->count++] = limage_read_lval(m);
+        if (m->failed) { break; }
+      }
+    break;
+    default:
+      /* Unknown tag, turn it into something safe to delete */
+      m->failed = 1;
+      v->type = LVAL_SEXPR;
+      v->count = 0;
+      v->cell = NULL;
+    break;
+  }
+  
+  /* Strings which could not be read are replaced so cleanup stays simple */
+  if ((v->type == LVAL_ERR && !v->err) || (v->type == LVAL_SYM && !v->sym)
+  ||  (v->type == LVAL_STR && !v->str)) {
+    v->type = LVAL_SEXPR;
+    v->count = 0;
+    v->cell = NULL;
+  }
+  if (v->type == LVAL_INST && !v->name) { v->name = calloc(1, 1); }
+  
+  return v;
+}
 
-    /* Evaluate each Expression */
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      /* If Evaluation leads to error print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
-    }
-    
-    /* Delete expressions and arguments */
-    lval_del(expr);    
-    lval_del(a);
-    
-    /* Return empty list */
-    return lval_sexpr();
-    
-  } else {
-    /* Get Parse Error as String */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-    
-    /* Create new error message using it */
-    lval* err = lval_err("Could not load Library %s", err_msg);
-    free(err_msg);
-    lval_del(a);
-    
-    /* Cleanup and return error */
-    return err;
+static lenv* limage_read_lenv(limage* m) {
+  lenv* e = lenv_new();
+  unsigned long count = limage_read_u32(m);
+  if (m->failed || count > (1UL << 28)) { m->failed = 1; return e; }
+  e->syms = malloc(sizeof(char*) * count);
+  e->vals = malloc(sizeof(lval*) * count);
+  for (unsigned long i = 0; i < count; i++) {
+    char* sym = limage_read_str(m);
+    if (!sym) { break; }
+    e->syms[e->count] = sym;
+    e->vals[e->count] = limage_read_lval(m);
+    e->count++;
+    if (m->failed) { break; }
   }
+  return e;
 }
 
-lval* builtin_print(lenv* e, lval* a) {
+lval* lenv_save_image(lenv* e, char* filename) {
   
-  /* Print each argument followed by a space */
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]); putchar(' ');
+  limage m;
+  m.f = fopen(filename, "wb");
+  m.failed = 0;
+  
+  if (!m.f) { return lval_err("Could not open image '%s' for writing", filename); }
+  
+  if (fwrite(LIMAGE_MAGIC, 1, 8, m.f) != 8) { m.failed = 1; }
+  limage_write_u32(&m, LIMAGE_VERSION);
+  limage_write_u32(&m, LBUILTINS_NUM);
+  for (int i = 0; i < LBUILTINS_NUM; i++) {
+    limage_write_str(&m, lbuiltins[i].name);
   }
+  limage_write_lenv(&m, e);
   
-  /* Print a newline and delete arguments */
-  putchar('\n');
-  lval_del(a);
+  if (fclose(m.f) != 0) { m.failed = 1; }
+  
+  if (m.failed) {
+    remove(filename);
+    return lval_err("Could not write image '%s'", filename);
+  }
   
   return lval_sexpr();
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
+lenv* lenv_load_image(char* filename, lval** err) {
   
-  /* Construct Error from first argument */
-  lval* err = lval_err(a->cell[0]->str);
+  char magic[8];
+  limage m;
+  m.f = fopen(filename, "rb");
+  m.failed = 0;
+  m.funcs = NULL;
+  m.funcs_num = 0;
   
-  /* Delete arguments and return */
-  lval_del(a);
-  return err;
-}
-
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_builtin(func);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
-}
-
-void lenv_add_builtins(lenv* e) {
-  /* Variable Functions */
-  lenv_add_builtin(e, "\\",  builtin_lambda);
-  lenv_add_builtin(e, "obj", builtin_object); // OBJECT IN THE MAKING
-  lenv_add_builtin(e, "instance", builtin_instance); // INSTANCE IN THE MAKING
-  lenv_add_builtin(e, "->", builtin_member); 
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=",   builtin_put);
+  if (!m.f) {
+    *err = lval_err("Could not open image '%s'", filename);
+    return NULL;
+  }
   
-  /* List Functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
+  if (fread(magic, 1, 8, m.f) != 8 || memcmp(magic, LIMAGE_MAGIC, 8) != 0
+  ||  limage_read_u32(&m) != LIMAGE_VERSION) {
+    fclose(m.f);
+    *err = lval_err("File '%s' is not an image for this interpreter", filename);
+    return NULL;
+  }
   
-  /* Mathematical Functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+  /* Resolve builtin names to functions */
+  unsigned long funcs_num = limage_read_u32(&m);
+  if (m.failed || funcs_num > 4096) { m.failed = 1; funcs_num = 0; }
+  m.funcs = calloc(funcs_num ? funcs_num : 1, sizeof(lbuiltin));
+  m.funcs_num = funcs_num;
+  for (unsigned long i = 0; i < funcs_num && !m.failed; i++) {
+    char* name = limage_read_str(&m);
+    if (!name) { break; }
+    for (int j = 0; j < LBUILTINS_NUM; j++) {
+      if (strcmp(lbuiltins[j].name, name) == 0) { m.funcs[i] = lbuiltins[j].func; break; }
+    }
+    free(name);
+  }
   
-  /* Comparison Functions */
-  lenv_add_builtin(e, "if", builtin_if);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
-  lenv_add_builtin(e, ">",  builtin_gt);
-  lenv_add_builtin(e, "<",  builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "<=", builtin_le);
+  lenv* e = m.failed ? lenv_new() : limage_read_lenv(&m);
   
-  /* String Functions */
-  lenv_add_builtin(e, "load",  builtin_load); 
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+  free(m.funcs);
+  fclose(m.f);
+  
+  if (m.failed) {
+    lenv_del(e);
+    *err = lval_err("Image '%s' is truncated or refers to unknown builtins", filename);
+    return NULL;
+  }
+  
+  *err = NULL;
+  return e;
 }
 
 tTuple find_member_variables(lval* a, lval* k)
@@ -1121,7 +4200,7 @@ lval* lval_object_call (lenv* e, lval* f, lval* a){
 	/* Record Argument Counts */
 	int given = a->count;
 	int total = f->objSlots->count;
-	printf("%i", a->count);
+	lout_num(&lstdout, (number){ typLong, { .l = a->count } });
 	while (a->count) {
 		/* If we've ran out of object slots to bind */
 		if (f->objSlots->count == 0) {
@@ -1209,20 +4288,72 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     lval_del(sym); lval_del(val);
   }
   
+  /* The body is shared by every copy of f and never changed, so it is evaluated in place */
   if (f->formals->count == 0) {  
     f->env->par = e;    
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    return lval_eval_body(f->env, f->body);
   } else {
     return lval_copy(f);
   }
   
 }
 
+lval* lval_eval_call(lenv* e, lval* v);
+
+lval* lval_macro_expand(lenv* e, lval* m, lval* v);
+
+/*
+** A special form or macro heading v is given it
+** before the rest of it is evaluated. Gives NULL
+** when v is to be evaluated as an ordinary call.
+*/
+static lval* lval_eval_form(lenv* e, lval* f, lval* v) {
+  if (v->count < 2 || f->type != LVAL_FUN) { return NULL; }
+  if (f->macro) { return lval_eval(e, lval_macro_expand(e, f, v)); }
+  return f->special ? f->special(e, v) : NULL;
+}
+
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lval_eval(e, v->cell[i]);
+    if (i == 0) {
+      lval* r = lval_eval_form(e, v->cell[0], v);
+      if (r) { lval_del(v); return r; }
+    }
+  }
+  return lval_eval_call(e, v);
+}
+
+/*
+** Evaluates v without using it up, for bodies which
+** are run over and over. Only the results are new, v
+** itself is never copied.
+*/
+lval* lval_eval_keep(lenv* e, lval* v) {
+  if (v->type == LVAL_SYM) { return lenv_get(e, v); }
+  if (v->type != LVAL_SEXPR) { return lval_copy(v); }
+  return lval_eval_body(e, v);
+}
+
+/* Evaluates the items of v as an S-Expression, whatever its type, without using it up */
+lval* lval_eval_body(lenv* e, lval* v) {
+  lval* x = lval_sexpr();
+  x->cell = malloc(sizeof(lval*) * (v->count ? v->count : 1));
+  for (int i = 0; i < v->count; i++) {
+    x->cell[x->count++] = lval_eval_keep(e, v->cell[i]);
+    if (i == 0) {
+      lval* r = lval_eval_form(e, x->cell[0], v);
+      if (r) { lval_del(x); return r; }
+    }
+  }
+  return lval_eval_call(e, x);
+}
+
+/* Calls the S-Expression v once all its items have been evaluated */
+lval* lval_eval_call(lenv* e, lval* v) {
   
   lval* result;
   
-  for (int i = 0; i < v->count; i++) { v->cell[i] = lval_eval(e, v->cell[i]); }
   for (int i = 0; i < v->count; i++) { if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); } }
   
   if (v->count == 0) { return v; }  
@@ -1267,23 +4398,212 @@ lval* lval_eval(lenv* e, lval* v) {
   return v;
 }
 
+/* Reader */
+
+/*
+** The grammar is built once and never changed after,
+** so any number of readers can share it. Each reader
+** adds the memory pool its parses run in. A reader
+** must only be used by one thread at a time, so each
+** thread that parses wants a reader of its own, and
+** then none of them need to lock anything.
+*/
+
+typedef struct {
+  mpc_parser_t* number;
+  mpc_parser_t* integer;
+  mpc_parser_t* dbl;
+  mpc_parser_t* symbol;
+  mpc_parser_t* string;
+  mpc_parser_t* comment;
+  mpc_parser_t* sexpr;
+  mpc_parser_t* qexpr;
+  mpc_parser_t* expr;
+  mpc_parser_t* lispy;
+} lgrammar;
+
+struct lreader {
+  lgrammar* g;
+  mpc_pool_t* pool;
+};
+
+/*
+** The grammar is compiled into AltLispGrammar.h so
+** that start up doesn't have to parse it and compile
+** its regular expressions every time. The table
+** records a hash of the grammar source it came from,
+** so if the source below is changed without running
+** `--dump-grammar AltLispGrammar.h` it is simply
+** built from source again.
+*/
+
+static const char* lgrammar_src =
+  "                                              \
+	  integer : /-?[0-9]+/ ;                       \
+	  double  : /-?[0-9]+\\.[0-9]+/ ;			   \
+      number  : <double> | <integer> ;             \
+      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
+      string  : /\"(\\\\.|[^\"\\\\])*\"/ ;        \
+      comment : /;[^\\r\\n]*/ ;                    \
+      sexpr   : '(' <expr>* ')' ;                  \
+      qexpr   : '{' <expr>* '}' ;                  \
+      expr    : <number>  | <symbol> | <string>    \
+              | <comment> | <sexpr>  | <qexpr>;    \
+      lispy   : /^/ <expr>* /$/ ;                  \
+    ";
+
+#include "AltLispGrammar.h"
+
+unsigned long lgrammar_hash(const char* s) {
+  unsigned long h = 2166136261UL;
+  while (*s) { h = ((h ^ (unsigned char)*s++) * 16777619UL) & 0xFFFFFFFFUL; }
+  return h;
+}
+
+/* Reports a grammar error through the output writer */
+static void lgrammar_err(mpc_err_t* err) {
+  char* s = mpc_err_string(err);
+  lout_puts(&lstdout, s);
+  lout_flush(&lstdout);
+  free(s);
+  mpc_err_delete(err);
+}
+
+lgrammar* lgrammar_new(int flags, int from_table) {
+  lgrammar* g = malloc(sizeof(lgrammar));
+  g->number  = mpc_new("number");
+  g->integer = mpc_new("integer");
+  g->dbl     = mpc_new("double");
+  g->symbol  = mpc_new("symbol");
+  g->string  = mpc_new("string");
+  g->comment = mpc_new("comment");
+  g->sexpr   = mpc_new("sexpr");
+  g->qexpr   = mpc_new("qexpr");
+  g->expr    = mpc_new("expr");
+  g->lispy   = mpc_new("lispy");
+  
+  /* A table which fails to load leaves the parsers undefined, so build them from source instead */
+  if (from_table && lgrammar_hash(lgrammar_src) == LGRAMMAR_HASH) {
+    mpc_err_t* err = mpca_table_load(flags, lgrammar_table, 10,
+      g->number, g->integer, g->dbl, g->symbol, g->string,
+      g->comment, g->sexpr, g->qexpr, g->expr, g->lispy);
+    if (!err) { return g; }
+    lgrammar_err(err);
+  }
+  
+  mpc_err_t* err = mpca_lang(flags, lgrammar_src,
+    g->number, g->integer, g->dbl, g->symbol, g->string,
+    g->comment, g->sexpr, g->qexpr, g->expr, g->lispy);
+  if (err) { lgrammar_err(err); }
+  
+  return g;
+}
+
+/* Write the grammar out as C source for AltLispGrammar.h */
+int lgrammar_dump(lgrammar* g, char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (!f) { return 0; }
+  fprintf(f, "/* Generated by `--dump-grammar`, do not edit. */\n\n");
+  fprintf(f, "#define LGRAMMAR_HASH 0x%08lxUL\n\n", lgrammar_hash(lgrammar_src));
+  mpc_err_t* err = mpca_table_write(f, "lgrammar_table", 10,
+    g->number, g->integer, g->dbl, g->symbol, g->string,
+    g->comment, g->sexpr, g->qexpr, g->expr, g->lispy);
+  fclose(f);
+  if (err) { lgrammar_err(err); return 0; }
+  return 1;
+}
+
+void lgrammar_del(lgrammar* g) {
+  mpc_cleanup(10, 
+    g->number, g->integer, g->dbl,   g->symbol, g->string, 
+    g->comment, g->sexpr,  g->qexpr, g->expr,   g->lispy);
+  free(g);
+}
+
+lreader* lreader_new(lgrammar* g) {
+  lreader* r = malloc(sizeof(lreader));
+  r->g = g;
+  r->pool = mpc_pool_new();
+  return r;
+}
+
+void lreader_del(lreader* r) {
+  mpc_pool_delete(r->pool);
+  free(r);
+}
+
 /* Reading */
 
-lval* lval_read_num(mpc_ast_t* t) {
-	number x;
-	if(strstr(t->tag, "integer")){
-		errno = 0;
-		x.value.l = strtol(t->contents, NULL, 10);
-		x.nType = typLong;
-		return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
-	}
-	else{
-		errno = 0;
-		x.value.d = strtod(t->contents, NULL);
-		x.nType = typDouble;
-		return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
-	}
+/*
+** Numbers are decoded straight from the token the
+** grammar matched, which is `-?[0-9]+` for integers
+** and `-?[0-9]+\.[0-9]+` for doubles, so no checks
+** beyond overflow are needed.
+**
+** A double whose digits fit in 53 bits and which has
+** at most 22 decimal places is exactly the quotient of
+** two doubles, and one division gives the correctly
+** rounded result. Anything longer goes to `strtod`.
+*/
+
+static const double lread_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+int lread_long(const char* s, long* out) {
+  int neg = (*s == '-');
+  if (neg) { s++; }
+  unsigned long limit = neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+  unsigned long x = 0;
+  for (; *s; s++) {
+    unsigned long d = (unsigned long)(*s - '0');
+    if (x > (limit - d) / 10) { return 0; }
+    x = x * 10 + d;
+  }
+  *out = neg ? (long)(0UL - x) : (long)x;
+  return 1;
+}
+
+int lread_double(const char* s, double* out) {
+  const char* start = s;
+  int neg = (*s == '-');
+  if (neg) { s++; }
+  
+  unsigned long long m = 0;
+  int digits = 0, places = 0, after = 0, nonzero = 0;
+  for (; *s; s++) {
+    if (*s == '.') { after = 1; continue; }
+    if (*s != '0') { nonzero = 1; }
+    if (m || *s != '0') { digits++; }
+    if (digits > 19) { break; }
+    m = m * 10 + (unsigned long long)(*s - '0');
+    places += after;
+  }
+  
+  if (digits <= 19 && m <= (1ULL << 53) && places <= 22) {
+    double x = (double)m / lread_pow10[places];
+    *out = neg ? -x : x;
+    return 1;
+  }
   
+  /* Too many digits for the fast path */
+  double x = strtod(start, NULL);
+  if (isinf(x) || (x == 0.0 && nonzero)) { return 0; }
+  *out = x;
+  return 1;
+}
+
+lval* lval_read_num(lreader* r, mpc_ast_t* t) {
+  number x;
+  if (t->tag_id == mpc_id(r->g->integer)) {
+    x.nType = typLong;
+    if (!lread_long(t->contents, &x.value.l)) { return lval_err("Invalid Number."); }
+  } else {
+    x.nType = typDouble;
+    if (!lread_double(t->contents, &x.value.d)) { return lval_err("Invalid Number."); }
+  }
+  return lval_num(x);
 }
 
 lval* lval_read_str(mpc_ast_t* t) {
@@ -1294,92 +4614,259 @@ lval* lval_read_str(mpc_ast_t* t) {
   strcpy(unescaped, t->contents+1);
   /* Pass through the unescape function */
   unescaped = mpcf_unescape(unescaped);
-  /* Construct a new lval using the string */
-  lval* str = lval_str(unescaped);
-  /* Free the string and return */
-  free(unescaped);
-  return str;
+  /* Construct a new lval which takes over the string */
+  return lval_lstr(lstr_take(unescaped, strlen(unescaped)));
 }
 
-lval* lval_read(mpc_ast_t* t) {
+lval* lval_read(lreader* r, mpc_ast_t* t) {
   
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  /* Dispatch on the id of the innermost named rule */
+  lgrammar* g = r->g;
+  int id = t->tag_id;
+  if (id == mpc_id(g->integer) || id == mpc_id(g->dbl)) { return lval_read_num(r, t); }
+  if (id == mpc_id(g->string)) { return lval_read_str(t); }
+  if (id == mpc_id(g->symbol)) { return lval_sym(t->contents); }
   
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); } 
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+  if (id == 0)                 { x = lval_sexpr(); } 
+  if (id == mpc_id(g->sexpr))  { x = lval_sexpr(); }
+  if (id == mpc_id(g->qexpr))  { x = lval_qexpr(); }
   
   for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+    /* Brackets and anchors belong to no named rule */
+    if (t->children[i]->tag_id == 0) { continue; }
+    if (t->children[i]->tag_id == mpc_id(g->comment)) { continue; }
+    x = lval_add(x, lval_read(r, t->children[i]));
   }
   
   return x;
 }
 
+/* Loading */
+
+lval* lval_read_file(lreader* rd, char* filename) {
+  
+  mpc_result_t r;
+  if (mpc_parse_contents_with(filename, rd->g->lispy, rd->pool, &r)) {
+    
+    /* Read contents */
+    lval* expr = lval_read(rd, r.output);
+    mpc_ast_delete(r.output);
+    return expr;
+    
+  } else {
+    /* Get Parse Error as String */
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    
+    /* Create new error message using it */
+    lval* err = lval_err("Could not load Library %s", err_msg);
+    free(err_msg);
+    return err;
+  }
+}
+
+void lval_eval_each(lenv* e, lval* expr) {
+  
+  while (expr->count) {
+    lval* x = lval_eval(e, lval_optimize(e, lval_expand(e, lval_pop(expr, 0))));
+    /* If Evaluation leads to error print it */
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+  }
+  
+  lval_del(expr);
+  lout_flush(&lstdout);
+}
+
+/*
+** Files given on the command line are read on a pool
+** of threads while the main thread evaluates them.
+** Each worker reads with a reader of its own over
+** the shared grammar.
+** Results are handed over in the order the files
+** were given, so evaluation happens exactly as if
+** each file was loaded in turn.
+*/
+
+#ifndef _WIN32
+
+typedef struct {
+  lgrammar* g;
+  char** files;
+  int files_num;
+  int next;
+  lval** read;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} lload_queue;
+
+void* lload_worker(void* arg) {
+  lload_queue* q = arg;
+  lreader* r = lreader_new(q->g);
+  
+  while (1) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->files_num) { lreader_del(r); return NULL; }
+    
+    lval* x = lval_read_file(r, q->files[i]);
+    
+    pthread_mutex_lock(&q->lock);
+    q->read[i] = x;
+    pthread_cond_broadcast(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+void lload_files(lenv* e, char** files, int files_num) {
+  
+  lload_queue q;
+  q.g = lenv_reader(e)->g;
+  q.files = files;
+  q.files_num = files_num;
+  q.next = 0;
+  q.read = calloc(files_num, sizeof(lval*));
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.ready, NULL);
+  
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads_num = cpus < 1 ? 1 : cpus < files_num ? (int)cpus : files_num;
+  pthread_t* threads = malloc(sizeof(pthread_t) * threads_num);
+  for (int i = 0; i < threads_num; i++) {
+    if (pthread_create(&threads[i], NULL, lload_worker, &q) != 0) { threads_num = i; break; }
+  }
+  
+  for (int i = 0; i < files_num; i++) {
+    
+    /* Wait for the file to be read, or read it here if there are no workers */
+    lval* x;
+    if (threads_num == 0) {
+      x = lval_read_file(lenv_reader(e), files[i]);
+    } else {
+      pthread_mutex_lock(&q.lock);
+      while (q.read[i] == NULL) { pthread_cond_wait(&q.ready, &q.lock); }
+      x = q.read[i];
+      pthread_mutex_unlock(&q.lock);
+    }
+    
+    /* If reading failed be sure to print it */
+    if (x->type == LVAL_ERR) { lval_println(x); lval_del(x); continue; }
+    lval_eval_each(e, x);
+  }
+  
+  for (int i = 0; i < threads_num; i++) { pthread_join(threads[i], NULL); }
+  free(threads);
+  free(q.read);
+  pthread_cond_destroy(&q.ready);
+  pthread_mutex_destroy(&q.lock);
+}
+
+#else
+
+void lload_files(lenv* e, char** files, int files_num) {
+  for (int i = 0; i < files_num; i++) {
+    lval* x = lval_read_file(lenv_reader(e), files[i]);
+    if (x->type == LVAL_ERR) { lval_println(x); lval_del(x); continue; }
+    lval_eval_each(e, x);
+  }
+}
+
+#endif
+
 /* Main */
 
 int main(int argc, char** argv) {
   
-  Number  = mpc_new("number");
-  Integer = mpc_new("integer");
-  Double  = mpc_new("double");
-  Symbol  = mpc_new("symbol");
-  String  = mpc_new("string");
-  Comment = mpc_new("comment");
-  Sexpr   = mpc_new("sexpr");
-  Qexpr   = mpc_new("qexpr");
-  Expr    = mpc_new("expr");
-  Lispy   = mpc_new("lispy");
-  
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                              \
-	  integer : /-?[0-9]+/ ;                       \
-	  double  : /-?[0-9]+\\.[0-9]+/ ;			   \
-      number  : <double> | <integer> ;             \
-      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-      string  : /\"(\\\\.|[^\"])*\"/ ;             \
-      comment : /;[^\\r\\n]*/ ;                    \
-      sexpr   : '(' <expr>* ')' ;                  \
-      qexpr   : '{' <expr>* '}' ;                  \
-      expr    : <number>  | <symbol> | <string>    \
-              | <comment> | <sexpr>  | <qexpr>;    \
-      lispy   : /^/ <expr>* /$/ ;                  \
-    ",
-    Number, Integer, Double, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  lstdout.f = stdout;
   
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
+  /* Split options from the list of files */
+  char* image = NULL;
+  char* save_image = NULL;
+  int packrat = 0;
+  char* dump_grammar = NULL;
+  int files_num = 0;
+  char** files = malloc(sizeof(char*) * argc);
+  
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+      image = argv[++i];
+    } else if (strcmp(argv[i], "--save-image") == 0 && i+1 < argc) {
+      save_image = argv[++i];
+    } else if (strcmp(argv[i], "--packrat") == 0) {
+      packrat = 1;
+    } else if (strcmp(argv[i], "--no-opt") == 0) {
+      lopt_enabled = 0;
+    } else if (strcmp(argv[i], "--dump-grammar") == 0 && i+1 < argc) {
+      dump_grammar = argv[++i];
+    } else {
+      files[files_num++] = argv[i];
+    }
+  }
+  
+  /* Errors are only built when a parse fails */
+  int flags = MPCA_LANG_LAZY_ERRORS;
+  if (packrat) { flags |= MPCA_LANG_MEMOISE; }
+  
+  /* Regenerate the compiled grammar from source */
+  if (dump_grammar) {
+    lgrammar* g = lgrammar_new(MPCA_LANG_DEFAULT, 0);
+    int ok = lgrammar_dump(g, dump_grammar);
+    if (!ok) { fprintf(stderr, "Could not write grammar to %s\n", dump_grammar); }
+    lgrammar_del(g);
+    free(files);
+    return ok ? 0 : 1;
+  }
+  
+  lgrammar* g = lgrammar_new(flags, 1);
+  lreader* reader = lreader_new(g);
+  
+  /* Start from an image if one was given, otherwise from scratch */
+  lenv* e;
+  if (image) {
+    lval* err;
+    e = lenv_load_image(image, &err);
+    if (!e) {
+      lval_println(err);
+      lval_del(err);
+      lout_flush(&lstdout);
+      free(files);
+      lreader_del(reader);
+      lgrammar_del(g);
+      return 1;
+    }
+  } else {
+    e = lenv_new();
+    lenv_add_builtins(e);
+  }
+  e->reader = reader;
   
   /* Interactive Prompt */
-  if (argc == 1) {
+  if (files_num == 0 && !save_image) {
   
-    puts("Lispy Version 0.0.1.1");
-    puts("Press Ctrl+c to Exit\n");
+    lout_puts(&lstdout, "Lispy Version 0.0.1.1\n");
+    lout_puts(&lstdout, "Press Ctrl+c to Exit\n\n");
   
     while (1) {
-    
+      
+      /* Everything so far must be out before the prompt */
+      lout_flush(&lstdout);
       char* input = readline("altLisp> ");
       add_history(input);
       
       mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
+      if (mpc_parse_with("<stdin>", input, g->lispy, reader->pool, &r)) {
         
-        lval* x = lval_eval(e, lval_read(r.output));
+        lval* x = lval_eval(e, lval_optimize(e, lval_expand(e, lval_read(reader, r.output))));
         lval_println(x);
         lval_del(x);
         
         mpc_ast_delete(r.output);
       } else {    
-        mpc_err_print(r.error);
+        char* err_msg = mpc_err_string(r.error);
+        lout_puts(&lstdout, err_msg);
+        free(err_msg);
         mpc_err_delete(r.error);
       }
       
@@ -1389,28 +4876,29 @@ int main(int argc, char** argv) {
   }
   
   /* Supplied with list of files */
-  if (argc >= 2) {
+  if (files_num > 0) { lload_files(e, files, files_num); }
   
-    /* loop over each supplied filename (starting from 1) */
-    for (int i = 1; i < argc; i++) {
-      
-      /* Argument list with a single argument, the filename */
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-      
-      /* Pass to builtin load and get the result */
-      lval* x = builtin_load(e, args);
-      
-      /* If the result is an error be sure to print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
-    }
+  /* Write out the environment as it stands after loading */
+  int status = 0;
+  if (save_image) {
+    lval* x = lenv_save_image(e, save_image);
+    if (x->type == LVAL_ERR) { lval_println(x); status = 1; }
+    lval_del(x);
   }
+  lout_flush(&lstdout);
   
-  lenv_del(e);
+  /* Report how much work the packrat table saved */
+  if (packrat) {
+    mpc_memo_stats_t ms;
+    mpc_memo_stats(&ms);
+    fprintf(stderr, "Packrat: %ld lookups, %ld hits (%.1f%%), %ld entries\n",
+      ms.lookups, ms.hits, ms.lookups ? 100.0 * ms.hits / ms.lookups : 0.0, ms.entries);
+  }
   
-  mpc_cleanup(10, 
-    Number, Integer, Double, Symbol, String, 
-	Comment, Sexpr,  Qexpr,  Expr,   Lispy);
+  free(files);
+  lenv_del(e);
+  lreader_del(reader);
+  lgrammar_del(g);
   
-  return 0;
+  return status;
 }
\ No newline at end of file
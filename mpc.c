@@ -1,5 +1,29 @@
 #include "mpc.h"
 
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define MPC_SCAN_AVX2
+#endif
+
+/* Shared counters are updated atomically where the compiler offers it */
+#if defined(__GNUC__)
+#define mpc_atomic_add(x, n) __sync_fetch_and_add((x), (n))
+#define mpc_atomic_set(x, n) __sync_lock_test_and_set((x), (n))
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define mpc_atomic_add(x, n) _InterlockedExchangeAdd((volatile long*)(x), (n))
+#define mpc_atomic_set(x, n) _InterlockedExchange((volatile long*)(x), (n))
+#else
+static long mpc_atomic_add(long *x, long n) { long y = *x; *x += n; return y; }
+static long mpc_atomic_set(long *x, long n) { long y = *x; *x = n; return y; }
+#endif
+
 /*
 ** State Type
 */
@@ -66,12 +90,145 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_POOL_CHUNK = 32768,
+  MPC_POOL_LARGE = 4096
+};
+
+/* Vector scans may read up to a vector past the end of a string, so string inputs are followed by this many zeroed bytes */
+enum {
+  MPC_SCAN_PAD = 32
+};
+
+/*
+** Allocations made while parsing come from a bump
+** arena which lives for one parse. Each input gets its
+** own arena unless one is passed in with
+** `mpc_parse_with` and friends, which lets a thread
+** that parses often keep reusing the same one. An
+** arena must only be used by one parse at a time.
+**
+** Each allocation is preceded by its size so it can
+** be grown or exported. Freeing the last thing that
+** was allocated, which is the common case when
+** backtracking, just moves the arena back. Anything
+** else goes on a free list for its size to be handed
+** out again. All of it is reclaimed at once when the
+** next parse starts.
+**
+** Allocations over `MPC_POOL_LARGE` go to `malloc`
+** and are counted as overflows. When the arena is
+** full a new chunk twice the size of the last one is
+** added in front of it. When a parse needs more than
+** one chunk the chunks are merged into one on reset,
+** so a reused arena settles at the size of its
+** largest parse and then stops calling `malloc`.
+**
+** Frees may be given memory from `malloc` as well,
+** so whether a pointer belongs to the arena is found
+** from where it points. The last allocation and
+** anything outside the span of all the chunks are
+** answered straight away, otherwise the chunks are
+** checked newest first, which is where most frees
+** land.
+*/
+
+typedef struct mpc_pool_chunk_t {
+  struct mpc_pool_chunk_t *next;
+  size_t size;
+  size_t used;
+} mpc_pool_chunk_t;
+
+struct mpc_pool_t {
+  mpc_pool_chunk_t *chunk;
+  char *lo, *hi;
+  char *last;
+  char *free[MPC_POOL_LARGE / sizeof(size_t) + 1];
+  mpc_pool_stats_t stats;
+};
+
+static char *mpc_pool_data(mpc_pool_chunk_t *c) {
+  return (char*)(c + 1);
+}
+
+static mpc_pool_chunk_t *mpc_pool_chunk_new(mpc_pool_t *pool, size_t size, mpc_pool_chunk_t *next) {
+  mpc_pool_chunk_t *c = malloc(sizeof(mpc_pool_chunk_t) + size);
+  c->next = next;
+  c->size = size;
+  c->used = 0;
+  if (pool->lo == NULL || mpc_pool_data(c) < pool->lo) { pool->lo = mpc_pool_data(c); }
+  if (pool->hi == NULL || mpc_pool_data(c) + size > pool->hi) { pool->hi = mpc_pool_data(c) + size; }
+  pool->stats.chunks++;
+  pool->stats.capacity += (long)size;
+  return c;
+}
+
+mpc_pool_t *mpc_pool_new(void) {
+  mpc_pool_t *pool = malloc(sizeof(mpc_pool_t));
+  memset(&pool->stats, 0, sizeof(mpc_pool_stats_t));
+  memset(pool->free, 0, sizeof(pool->free));
+  pool->lo = pool->hi = NULL;
+  pool->chunk = mpc_pool_chunk_new(pool, MPC_POOL_CHUNK, NULL);
+  pool->last = NULL;
+  return pool;
+}
+
+void mpc_pool_delete(mpc_pool_t *pool) {
+  mpc_pool_chunk_t *c, *n;
+  for (c = pool->chunk; c; c = n) { n = c->next; free(c); }
+  free(pool);
+}
+
+void mpc_pool_stats(mpc_pool_t *pool, mpc_pool_stats_t *s) {
+  *s = pool->stats;
+}
+
+static void mpc_pool_reset(mpc_pool_t *pool) {
+  
+  mpc_pool_chunk_t *c, *n;
+  size_t total = 0;
+  
+  pool->last = NULL;
+  memset(pool->free, 0, sizeof(pool->free));
+  
+  if (pool->chunk->next == NULL) {
+    pool->chunk->used = 0;
+    return;
+  }
+  
+  for (c = pool->chunk; c; c = n) {
+    n = c->next;
+    total += c->size;
+    pool->stats.capacity -= (long)c->size;
+    free(c);
+  }
+  
+  pool->lo = pool->hi = NULL;
+  pool->chunk = mpc_pool_chunk_new(pool, total, NULL);
+}
+
+struct mpc_memo_t;
+typedef struct mpc_memo_t mpc_memo_t;
+
+struct mpc_dfa_t;
+typedef struct mpc_dfa_t mpc_dfa_t;
+
+enum {
+  MPC_LAZY_EXPECTED_MAX = 32
 };
 
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  const char *expected;
+  mpc_dfa_t *dfa;
+  int dfa_state;
+} mpc_lazy_expected_t;
+
+typedef struct {
+  mpc_state_t state;
+  char recieved;
+  const char *failure;
+  int expected_num;
+  mpc_lazy_expected_t expected[MPC_LAZY_EXPECTED_MAX];
+} mpc_lazy_err_t;
 
 typedef struct {
 
@@ -80,6 +237,7 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
+  long length;
   char *buffer;
   FILE *file;
   
@@ -92,9 +250,13 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  mpc_memo_t *memo;
+  
+  int lazy;
+  mpc_lazy_err_t lazy_err;
+  
+  mpc_pool_t *pool;
+  int pool_owned;
   
 } mpc_input_t;
 
@@ -108,8 +270,10 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
+  i->length = (long)strlen(string);
+  i->string = malloc(i->length + 1 + MPC_SCAN_PAD);
   strcpy(i->string, string);
+  memset(i->string + i->length + 1, 0, MPC_SCAN_PAD);
   i->buffer = NULL;
   i->file = NULL;
   
@@ -121,8 +285,11 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->lazy = 0;
+  
+  i->pool = NULL;
+  i->pool_owned = 0;
   
   return i;
 }
@@ -137,9 +304,11 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   
   i->state = mpc_state_new();
   
-  i->string = malloc(length + 1);
+  i->string = malloc(length + 1 + MPC_SCAN_PAD);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
+  memset(i->string + length + 1, 0, MPC_SCAN_PAD);
+  i->length = (long)strlen(i->string);
   i->buffer = NULL;
   i->file = NULL;
   
@@ -151,8 +320,11 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->lazy = 0;
+  
+  i->pool = NULL;
+  i->pool_owned = 0;
   
   return i;
 
@@ -169,6 +341,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
   
@@ -180,8 +353,11 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->lazy = 0;
+  
+  i->pool = NULL;
+  i->pool_owned = 0;
   
   return i;
   
@@ -197,6 +373,7 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
   
@@ -208,12 +385,17 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->lazy = 0;
+  
+  i->pool = NULL;
+  i->pool_owned = 0;
   
   return i;
 }
 
+static void mpc_memo_delete(mpc_memo_t *m);
+
 static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
@@ -221,35 +403,60 @@ static void mpc_input_delete(mpc_input_t *i) {
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  mpc_memo_delete(i->memo);
+  
+  if (i->pool_owned) { mpc_pool_delete(i->pool); }
+  
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+  mpc_pool_chunk_t *c;
+  if (p != NULL && (char*)p == i->pool->last) { return 1; }
+  if ((char*)p < i->pool->lo || (char*)p >= i->pool->hi) { return 0; }
+  for (c = i->pool->chunk; c; c = c->next) {
+    if ((char*)p >= mpc_pool_data(c) && (char*)p < mpc_pool_data(c) + c->used) { return 1; }
+  }
+  return 0;
+}
+
+static size_t mpc_mem_size(void *p) {
+  return ((size_t*)p)[-1];
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
+  
+  mpc_pool_t *pool = i->pool;
+  mpc_pool_chunk_t *c = pool->chunk;
+  size_t size = n ? (n + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1) : sizeof(size_t);
   char *p;
   
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  if (size > MPC_POOL_LARGE) {
+    pool->stats.overflows++;
+    pool->stats.overflow_bytes += (long)n;
+    return malloc(n);
+  }
   
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  pool->stats.allocs++;
+  
+  p = pool->free[size / sizeof(size_t)];
+  if (p) {
+    pool->free[size / sizeof(size_t)] = *(char**)p;
+    return p;
+  }
+  
+  if (c->used + sizeof(size_t) + size > c->size) {
+    c = mpc_pool_chunk_new(pool, c->size * 2, c);
+    pool->chunk = c;
+  }
   
-  return malloc(n);
+  p = mpc_pool_data(c) + c->used + sizeof(size_t);
+  ((size_t*)p)[-1] = size;
+  c->used += sizeof(size_t) + size;
+  pool->last = p;
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -259,33 +466,50 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
+  mpc_pool_t *pool = i->pool;
+  size_t size;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  size = mpc_mem_size(p);
+  if (p == pool->last) {
+    pool->chunk->used -= sizeof(size_t) + size;
+    pool->last = NULL;
+    return;
+  }
+  *(char**)p = pool->free[size / sizeof(size_t)];
+  pool->free[size / sizeof(size_t)] = p;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
+  mpc_pool_t *pool = i->pool;
+  mpc_pool_chunk_t *c = pool->chunk;
+  size_t old, size;
   char *q = NULL;
   
   if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
   
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
+  old = mpc_mem_size(p);
+  if (n <= old) { return p; }
+  
+  /* The last allocation can grow in place */
+  size = (n + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+  if (p == pool->last && size <= MPC_POOL_LARGE && c->used - old + size <= c->size) {
+    c->used += size - old;
+    ((size_t*)p)[-1] = size;
+    return p;
   }
   
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, old);
+  mpc_free(i, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
   if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  q = malloc(mpc_mem_size(p));
+  memcpy(q, p, mpc_mem_size(p));
   mpc_free(i, p);
   return q; 
 }
@@ -362,7 +586,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -542,6 +766,192 @@ static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   return r;
 }
 
+/*
+** Scanning
+*/
+
+/*
+** Runs of whitespace, comment bodies and string
+** bodies make up most of a typical input. For string
+** input these are skipped with vector compares over
+** 16 or 32 bytes at a time rather than per character.
+**
+** A scan set holds up to eight bytes. A span scan
+** skips bytes which are in the set, a stop scan skips
+** bytes which are not. The terminating null always
+** ends a scan. Vector loads are aligned, and a load
+** which holds the null can reach up to a vector past
+** it, so scans are only run over string inputs, which
+** carry MPC_SCAN_PAD zeroed bytes after the null.
+*/
+
+enum {
+  MPC_SCAN_SET_MAX = 8
+};
+
+typedef struct {
+  int n;
+  int span;
+  char bytes[MPC_SCAN_SET_MAX];
+  unsigned char in[256];
+} mpc_scan_set_t;
+
+static void mpc_scan_set_init(mpc_scan_set_t *s, const char *bytes, int n, int span) {
+  int j;
+  s->n = n;
+  s->span = span;
+  memset(s->in, 0, sizeof(s->in));
+  for (j = 0; j < n; j++) {
+    s->bytes[j] = bytes[j];
+    s->in[(unsigned char)bytes[j]] = 1;
+  }
+}
+
+#if defined(__SSE2__)
+
+static long mpc_scan_sse2(const char *x, mpc_scan_set_t *s, int span) {
+  
+  int j;
+  unsigned mask;
+  const char *p = x;
+  __m128i set[MPC_SCAN_SET_MAX], zero, v, m;
+  
+  while (((uintptr_t)p & 15) != 0) {
+    if (*p == '\0' || s->in[(unsigned char)*p] != span) { return (long)(p - x); }
+    p++;
+  }
+  
+  for (j = 0; j < s->n; j++) { set[j] = _mm_set1_epi8(s->bytes[j]); }
+  zero = _mm_setzero_si128();
+  
+  while (1) {
+    v = _mm_load_si128((const __m128i*)p);
+    m = _mm_setzero_si128();
+    for (j = 0; j < s->n; j++) { m = _mm_or_si128(m, _mm_cmpeq_epi8(v, set[j])); }
+    mask = (unsigned)_mm_movemask_epi8(m);
+    if (span) { mask = ~mask & 0xFFFF; }
+    mask |= (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+    if (mask) { return (long)(p - x) + __builtin_ctz(mask); }
+    p += 16;
+  }
+}
+
+#endif
+
+#if defined(MPC_SCAN_AVX2)
+
+__attribute__((target("avx2")))
+static long mpc_scan_avx2(const char *x, mpc_scan_set_t *s, int span) {
+  
+  int j;
+  unsigned mask;
+  const char *p = x;
+  __m256i set[MPC_SCAN_SET_MAX], zero, v, m;
+  
+  while (((uintptr_t)p & 31) != 0) {
+    if (*p == '\0' || s->in[(unsigned char)*p] != span) { return (long)(p - x); }
+    p++;
+  }
+  
+  for (j = 0; j < s->n; j++) { set[j] = _mm256_set1_epi8(s->bytes[j]); }
+  zero = _mm256_setzero_si256();
+  
+  while (1) {
+    v = _mm256_load_si256((const __m256i*)p);
+    m = _mm256_setzero_si256();
+    for (j = 0; j < s->n; j++) { m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, set[j])); }
+    mask = (unsigned)_mm256_movemask_epi8(m);
+    if (span) { mask = ~mask; }
+    mask |= (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+    if (mask) { return (long)(p - x) + __builtin_ctz(mask); }
+    p += 32;
+  }
+}
+
+#endif
+
+#if !defined(__SSE2__)
+
+static long mpc_scan_scalar(const char *x, mpc_scan_set_t *s, int span) {
+  const char *p = x;
+  while (*p != '\0' && s->in[(unsigned char)*p] == span) { p++; }
+  return (long)(p - x);
+}
+
+#endif
+
+static long mpc_scan(const char *x, mpc_scan_set_t *s) {
+  
+  /* Short runs are the common case so check the first byte inline */
+  if (*x == '\0' || s->in[(unsigned char)*x] != s->span) { return 0; }
+  
+#if defined(MPC_SCAN_AVX2)
+  if (__builtin_cpu_supports("avx2")) { return mpc_scan_avx2(x, s, s->span); }
+#endif
+#if defined(__SSE2__)
+  return mpc_scan_sse2(x, s, s->span);
+#else
+  return mpc_scan_scalar(x, s, s->span);
+#endif
+}
+
+static void mpc_state_advance(mpc_state_t *s, const char *x, long n) {
+  const char *p = x, *q;
+  s->pos += n;
+  while ((q = memchr(p, '\n', (size_t)(x + n - p))) != NULL) {
+    s->row++;
+    p = q + 1;
+  }
+  s->col = p == x ? s->col + n : (long)(x + n - p);
+}
+
+static mpc_scan_set_t mpc_scan_whitespace = { 6, 1, " \f\n\r\t\v",
+  { [' '] = 1, ['\f'] = 1, ['\n'] = 1, ['\r'] = 1, ['\t'] = 1, ['\v'] = 1 } };
+
+static int mpc_input_spaces(mpc_input_t *i, char **o) {
+  
+  long n;
+  char c;
+  const char *s;
+  char *buff = NULL;
+  long buff_num = 0, buff_slots = 0;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    s = i->string + i->state.pos;
+    n = mpc_scan(s, &mpc_scan_whitespace);
+    if (n > 0) { i->last = s[n-1]; }
+    mpc_state_advance(&i->state, s, n);
+    if (o) {
+      *o = mpc_malloc(i, n + 1);
+      memcpy(*o, s, n);
+      (*o)[n] = '\0';
+    }
+    return 1;
+  }
+  
+  while (1) {
+    c = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    if (!mpc_scan_whitespace.in[(unsigned char)c]) { mpc_input_failure(i, c); break; }
+    mpc_input_success(i, c, NULL);
+    if (o) {
+      if (buff_num + 1 >= buff_slots) {
+        buff_slots = buff_slots ? buff_slots * 2 : 64;
+        buff = realloc(buff, buff_slots);
+      }
+      buff[buff_num++] = c;
+    }
+  }
+  
+  if (o) {
+    *o = mpc_malloc(i, buff_num + 1);
+    if (buff_num > 0) { memcpy(*o, buff, buff_num); }
+    (*o)[buff_num] = '\0';
+    free(buff);
+  }
+  return 1;
+}
+
 /*
 ** Error Type
 */
@@ -575,9 +985,7 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
   
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
@@ -607,6 +1015,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0; 
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char char_unescape_buffer[4];
   
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -631,15 +1040,69 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, char_unescape_buffer));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
 }
 
+/*
+** Rules of a grammar built with `MPCA_LANG_LAZY_ERRORS`
+** parse without building any errors. Most failures
+** are alternatives being tried and thrown away, so
+** instead the input keeps the furthest position
+** anything failed at, along with the messages (or
+** the DFA states) expected there. The full error is
+** only built from this if the whole parse fails.
+**
+** The result is the same as merging all the errors
+** except that the "one or more of" and "n of"
+** prefixes added by repeats are left out.
+*/
+
+static char mpc_input_peekc(mpc_input_t *i);
+
+static void mpc_lazy_record(mpc_input_t *i, const char *expected, const char *failure, mpc_dfa_t *d, int state) {
+  
+  int j;
+  mpc_lazy_err_t *l = &i->lazy_err;
+  
+  /* Only failures which would have been reported count */
+  if (i->suppress != 1) { return; }
+  if (i->state.pos < l->state.pos) { return; }
+  
+  if (i->state.pos > l->state.pos) {
+    l->state = i->state;
+    l->recieved = failure ? ' ' : mpc_input_peekc(i);
+    l->failure = NULL;
+    l->expected_num = 0;
+  }
+  
+  if (failure) {
+    if (l->failure == NULL) { l->failure = failure; }
+    return;
+  }
+  
+  for (j = 0; j < l->expected_num; j++) {
+    if (l->expected[j].expected == expected
+    &&  l->expected[j].dfa == d
+    &&  l->expected[j].dfa_state == state) { return; }
+  }
+  
+  if (l->expected_num == MPC_LAZY_EXPECTED_MAX) { return; }
+  
+  l->expected[l->expected_num].expected = expected;
+  l->expected[l->expected_num].dfa = d;
+  l->expected[l->expected_num].dfa_state = state;
+  l->expected_num++;
+}
+
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress) {
+    if (i->lazy) { mpc_lazy_record(i, expected, NULL, NULL, 0); }
+    return NULL;
+  }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -655,7 +1118,10 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
 
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress) {
+    if (i->lazy) { mpc_lazy_record(i, NULL, failure, NULL, 0); }
+    return NULL;
+  }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -882,7 +1348,11 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25,
+  MPC_TYPE_SPACES    = 26,
+  MPC_TYPE_BLANK     = 27
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -901,6 +1371,21 @@ typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdat
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
+struct mpc_dfa_t {
+  int states_num;
+  int classes_num;
+  int start;
+  unsigned char classes[256];
+  int *trans;
+  char *accept;
+  int *scan;
+  int scans_num;
+  mpc_scan_set_t *scans;
+  char *re;
+};
+
+typedef struct { mpc_dfa_t *d; } mpc_pdata_dfa_t;
+
 typedef union {
   mpc_pdata_fail_t fail;
   mpc_pdata_lift_t lift;
@@ -917,13 +1402,17 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
   char *name;
+  int id;
   mpc_pdata_t data;
   char type;
   char retained;
+  char memo;
+  char lazy;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -981,19 +1470,406 @@ static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
   return a;
 }
 
-static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
-  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
-  return f(mpc_export(i, x));
+static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
+  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  return f(mpc_export(i, x));
+}
+
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  return f(mpc_export(i, x), d);
+}
+
+static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (d == free) { mpc_free(i, x); return; }
+  d(mpc_export(i, x));
+}
+
+/*
+** DFA Matching
+*/
+
+/*
+** Regex terminals which `mpc_re` manages to compile
+** to a DFA are matched here rather than by walking a
+** tree of combinators. For string input this is a
+** single loop over the bytes of the input, with the
+** state updated once for the whole token. Other
+** inputs are read character by character as usual.
+**
+** The match is the longest prefix accepted by the
+** DFA. When nothing is accepted the error is placed
+** where the DFA got stuck, expecting whatever bytes
+** that state could have moved on.
+*/
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  if (d == NULL) { return; }
+  free(d->trans);
+  free(d->accept);
+  free(d->scan);
+  free(d->scans);
+  free(d->re);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *d) {
+  mpc_dfa_t *c = malloc(sizeof(mpc_dfa_t));
+  *c = *d;
+  c->trans = malloc(sizeof(int) * d->states_num * d->classes_num);
+  memcpy(c->trans, d->trans, sizeof(int) * d->states_num * d->classes_num);
+  c->accept = malloc(d->states_num);
+  memcpy(c->accept, d->accept, d->states_num);
+  c->scan = malloc(sizeof(int) * d->states_num);
+  memcpy(c->scan, d->scan, sizeof(int) * d->states_num);
+  c->scans = malloc(sizeof(mpc_scan_set_t) * (d->scans_num + 1));
+  memcpy(c->scans, d->scans, sizeof(mpc_scan_set_t) * d->scans_num);
+  c->re = malloc(strlen(d->re) + 1);
+  strcpy(c->re, d->re);
+  return c;
+}
+
+static char *mpc_dfa_expected(mpc_dfa_t *d, int state) {
+  
+  int c, n = 0;
+  char in[256], out[256];
+  int in_num = 0, out_num = 0;
+  char *s;
+  
+  for (c = 1; c < 256; c++) {
+    if (d->trans[state * d->classes_num + d->classes[c]] != -1) {
+      in[in_num++] = (char)c; n++;
+    } else {
+      out[out_num++] = (char)c;
+    }
+  }
+  in[in_num] = '\0';
+  out[out_num] = '\0';
+  
+  s = malloc(strlen("none of ''") + 256 + 1);
+  if (n == 255)     { strcpy(s, "any character"); }
+  else if (n == 1)  { sprintf(s, "'%s'", in); }
+  else if (n < 128) { sprintf(s, "one of '%s'", in); }
+  else              { sprintf(s, "none of '%s'", out); }
+  return s;
+}
+
+static mpc_err_t *mpc_dfa_err(mpc_input_t *i, mpc_dfa_t *d, int state) {
+  mpc_err_t *x;
+  char *expected;
+  if (i->suppress) {
+    if (i->lazy) { mpc_lazy_record(i, NULL, NULL, d, state); }
+    return NULL;
+  }
+  expected = mpc_dfa_expected(d, state);
+  x = mpc_err_new(i, expected);
+  free(expected);
+  return x;
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o, mpc_err_t **err) {
+  
+  int state = d->start, next;
+  long j, n, accepted = d->accept[state] ? 0 : -1;
+  const char *s;
+  mpc_state_t start;
+  char *buff = NULL;
+  long buff_num = 0, buff_slots = 0;
+  char c;
+  
+  *err = NULL;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    
+    s = i->string + i->state.pos;
+    j = 0;
+    while (1) {
+      if (d->scan[state] != -1) {
+        n = mpc_scan(s + j, &d->scans[d->scan[state]]);
+        if (n > 0) {
+          j += n;
+          if (d->accept[state]) { accepted = j; }
+        }
+      }
+      if (s[j] == '\0') { break; }
+      next = d->trans[state * d->classes_num + d->classes[(unsigned char)s[j]]];
+      if (next == -1) { break; }
+      state = next;
+      j++;
+      if (d->accept[state]) { accepted = j; }
+    }
+    
+    if (accepted == -1) {
+      start = i->state;
+      mpc_state_advance(&i->state, s, j);
+      *err = mpc_dfa_err(i, d, state);
+      i->state = start;
+      return 0;
+    }
+    
+    *o = mpc_malloc(i, accepted + 1);
+    memcpy(*o, s, accepted);
+    (*o)[accepted] = '\0';
+    if (accepted > 0) { i->last = s[accepted-1]; }
+    mpc_state_advance(&i->state, s, accepted);
+    return 1;
+  }
+  
+  /* Files and pipes need to be read to find the end of the match */
+  mpc_input_backtrack_enable(i);
+  mpc_input_mark(i);
+  mpc_input_mark(i);
+  
+  while (1) {
+    c = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    next = d->trans[state * d->classes_num + d->classes[(unsigned char)c]];
+    if (next == -1) { mpc_input_failure(i, c); break; }
+    mpc_input_success(i, c, NULL);
+    state = next;
+    if (buff_num + 1 >= buff_slots) {
+      buff_slots = buff_slots ? buff_slots * 2 : 64;
+      buff = realloc(buff, buff_slots);
+    }
+    buff[buff_num++] = c;
+    if (d->accept[state]) { accepted = buff_num; }
+  }
+  
+  if (accepted == -1) {
+    *err = mpc_dfa_err(i, d, state);
+    mpc_input_rewind(i);
+    mpc_input_rewind(i);
+    mpc_input_backtrack_disable(i);
+    free(buff);
+    return 0;
+  }
+  
+  /* Step back to the end of the longest match */
+  if (accepted != buff_num) {
+    mpc_input_rewind(i);
+    for (j = 0; j < accepted; j++) {
+      c = mpc_input_getc(i);
+      mpc_input_success(i, c, NULL);
+    }
+  } else {
+    mpc_input_unmark(i);
+  }
+  mpc_input_unmark(i);
+  mpc_input_backtrack_disable(i);
+  
+  *o = mpc_malloc(i, accepted + 1);
+  if (accepted > 0) { memcpy(*o, buff, accepted); }
+  (*o)[accepted] = '\0';
+  free(buff);
+  return 1;
+}
+
+/*
+** Memoisation
+*/
+
+/*
+** Rules of a grammar built with `MPCA_LANG_MEMOISE`
+** are marked so that `mpc_parse_run` records the
+** result of trying them at each input position.
+** Asking for the same rule at the same position
+** again replays the recorded result instead of
+** parsing again, which bounds the work done by a
+** backtracking grammar to one attempt per rule per
+** position, making parsing linear in the input.
+**
+** Only grammar rules are marked because their
+** output is known to be an `mpc_ast_t`, which the
+** table can copy. The table lives on the input so
+** it is thrown away along with it.
+**
+** Errors merged into the furthest failure while a
+** rule runs are not replayed on a hit, so error
+** messages may list fewer alternatives than the
+** unmemoised parse would.
+*/
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  char success;
+  char last;
+  mpc_state_t end;
+  mpc_ast_t *output;
+  mpc_err_t *error;
+  int has_error;
+} mpc_memo_entry_t;
+
+struct mpc_memo_t {
+  size_t slots;
+  size_t num;
+  mpc_memo_entry_t *entries;
+  mpc_memo_stats_t stats;
+};
+
+/*
+** Each table counts for itself and adds its counts
+** to the totals when it is deleted, so inputs being
+** parsed on different threads don't share counters.
+*/
+
+static mpc_memo_stats_t mpc_memo_stats_global = { 0, 0, 0 };
+
+void mpc_memo_stats(mpc_memo_stats_t *s) {
+  s->lookups = mpc_atomic_add(&mpc_memo_stats_global.lookups, 0);
+  s->hits = mpc_atomic_add(&mpc_memo_stats_global.hits, 0);
+  s->entries = mpc_atomic_add(&mpc_memo_stats_global.entries, 0);
+}
+
+void mpc_memo_stats_reset(void) {
+  mpc_atomic_set(&mpc_memo_stats_global.lookups, 0);
+  mpc_atomic_set(&mpc_memo_stats_global.hits, 0);
+  mpc_atomic_set(&mpc_memo_stats_global.entries, 0);
+}
+
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  y->state = x->state;
+  y->recieved = x->recieved;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  return y;
+}
+
+static void mpc_memo_delete(mpc_memo_t *m) {
+  size_t j;
+  if (m == NULL) { return; }
+  mpc_atomic_add(&mpc_memo_stats_global.lookups, m->stats.lookups);
+  mpc_atomic_add(&mpc_memo_stats_global.hits, m->stats.hits);
+  mpc_atomic_add(&mpc_memo_stats_global.entries, m->stats.entries);
+  for (j = 0; j < m->slots; j++) {
+    if (m->entries[j].p == NULL) { continue; }
+    mpc_ast_delete(m->entries[j].output);
+    if (m->entries[j].error) { mpc_err_delete(m->entries[j].error); }
+  }
+  free(m->entries);
+  free(m);
+}
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos) {
+  size_t h = (size_t)p;
+  h ^= (size_t)pos * 0x9E3779B1u;
+  h ^= h >> 15;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  return h;
+}
+
+static mpc_memo_entry_t *mpc_memo_find(mpc_memo_t *m, mpc_parser_t *p, long pos) {
+  size_t j = mpc_memo_hash(p, pos) & (m->slots-1);
+  while (m->entries[j].p != NULL) {
+    if (m->entries[j].p == p && m->entries[j].pos == pos) { break; }
+    j = (j+1) & (m->slots-1);
+  }
+  return &m->entries[j];
+}
+
+static void mpc_memo_grow(mpc_memo_t *m) {
+  size_t j;
+  size_t old_slots = m->slots;
+  mpc_memo_entry_t *old = m->entries;
+  m->slots = old_slots * 2;
+  m->entries = calloc(m->slots, sizeof(mpc_memo_entry_t));
+  for (j = 0; j < old_slots; j++) {
+    if (old[j].p == NULL) { continue; }
+    *mpc_memo_find(m, old[j].p, old[j].pos) = old[j];
+  }
+  free(old);
+}
+
+static mpc_memo_entry_t *mpc_memo_lookup(mpc_input_t *i, mpc_parser_t *p) {
+  
+  if (i->memo == NULL) {
+    i->memo = malloc(sizeof(mpc_memo_t));
+    i->memo->slots = 256;
+    i->memo->num = 0;
+    i->memo->entries = calloc(i->memo->slots, sizeof(mpc_memo_entry_t));
+    memset(&i->memo->stats, 0, sizeof(mpc_memo_stats_t));
+  }
+  
+  i->memo->stats.lookups++;
+  return mpc_memo_find(i->memo, p, i->state.pos);
+}
+
+static void mpc_memo_store(mpc_input_t *i, mpc_parser_t *p, long pos, int success, mpc_result_t *r) {
+  
+  mpc_memo_entry_t *x;
+  
+  if ((i->memo->num+1) * 2 > i->memo->slots) { mpc_memo_grow(i->memo); }
+  
+  x = mpc_memo_find(i->memo, p, pos);
+  if (x->p == NULL) {
+    i->memo->num++;
+    i->memo->stats.entries++;
+  } else {
+    mpc_ast_delete(x->output);
+    if (x->error) { mpc_err_delete(x->error); }
+  }
+  
+  x->p = p;
+  x->pos = pos;
+  x->success = success;
+  x->end = i->state;
+  x->last = i->last;
+  x->output = success ? mpc_ast_copy(r->output) : NULL;
+  x->error = success ? NULL : mpc_err_copy(r->error);
+  x->has_error = success || !i->suppress;
 }
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  int x;
+  long pos = i->state.pos;
+  mpc_memo_entry_t *m = mpc_memo_lookup(i, p);
+  
+  /* Replay a recorded result */
+  if (m->p != NULL && (m->has_error || i->suppress)) {
+    i->memo->stats.hits++;
+    if (m->success) {
+      i->state = m->end;
+      i->last = m->last;
+      if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+      r->output = mpc_ast_copy(m->output);
+      return 1;
+    } else {
+      r->error = i->suppress ? NULL : mpc_err_copy(m->error);
+      return 0;
+    }
+  }
+  
+  x = mpc_parse_node(i, p, r, e);
+  mpc_memo_store(i, p, pos, x, r);
+  return x;
 }
 
-static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
-  d(mpc_export(i, x));
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  if (p->memo && i->type != MPC_INPUT_PIPE && i->backtrack > 0) {
+    return mpc_parse_memo(i, p, r, e);
+  }
+  return mpc_parse_node(i, p, r, e);
 }
 
 enum {
@@ -1006,7 +1882,7 @@ enum {
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
@@ -1025,6 +1901,11 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
     case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_SPACES:  MPC_PRIMITIVE(mpc_input_spaces(i, (char**)&r->output));
+    case MPC_TYPE_BLANK:   r->output = NULL; MPC_PRIMITIVE(mpc_input_spaces(i, NULL));
+    case MPC_TYPE_DFA:
+      if (mpc_input_dfa(i, p->data.dfa.d, (char**)&r->output, &r->error)) { MPC_SUCCESS(r->output); }
+      else { MPC_FAILURE(r->error); }
     
     /* Other parsers */
     
@@ -1232,11 +2113,68 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+/* Builds the error recorded by a lazy parse */
+static mpc_err_t *mpc_lazy_err(mpc_input_t *i) {
+  
+  int j;
+  char *expected;
+  mpc_err_t *x;
+  mpc_lazy_err_t *l = &i->lazy_err;
+  
+  if (l->state.pos < 0) { return NULL; }
+  
+  i->suppress = 0;
+  i->state = l->state;
+  
+  if (l->failure) { return mpc_err_fail(i, l->failure); }
+  
+  x = mpc_malloc(i, sizeof(mpc_err_t));
+  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
+  strcpy(x->filename, i->filename);
+  x->state = l->state;
+  x->expected_num = 0;
+  x->expected = NULL;
+  x->failure = NULL;
+  x->recieved = l->recieved;
+  
+  for (j = 0; j < l->expected_num; j++) {
+    if (l->expected[j].dfa) {
+      expected = mpc_dfa_expected(l->expected[j].dfa, l->expected[j].dfa_state);
+      if (!mpc_err_contains_expected(i, x, expected)) { mpc_err_add_expected(i, x, expected); }
+      free(expected);
+    } else if (!mpc_err_contains_expected(i, x, (char*)l->expected[j].expected)) {
+      mpc_err_add_expected(i, x, (char*)l->expected[j].expected);
+    }
+  }
+  
+  return x;
+}
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  mpc_err_t *e;
+  
+  if (i->pool == NULL) {
+    i->pool = mpc_pool_new();
+    i->pool_owned = 1;
+  } else {
+    mpc_pool_reset(i->pool);
+  }
+  
+  e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
+  
+  if (p->lazy) {
+    i->lazy = 1;
+    i->suppress = 1;
+    i->lazy_err.state = mpc_state_invalid();
+    i->lazy_err.failure = NULL;
+    i->lazy_err.expected_num = 0;
+  }
+  
   x = mpc_parse_run(i, p, r, &e);
+  if (!x && i->lazy) { r->error = mpc_lazy_err(i); }
+  
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1247,16 +2185,26 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
 }
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_with(filename, string, p, NULL, r);
+}
+
+int mpc_parse_with(const char *filename, const char *string, mpc_parser_t *p, mpc_pool_t *pool, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_string(filename, string);
+  i->pool = pool;
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
 }
 
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_nparse_with(filename, string, length, p, NULL, r);
+}
+
+int mpc_nparse_with(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_pool_t *pool, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  i->pool = pool;
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1279,8 +2227,14 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
 }
 
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_contents_with(filename, p, NULL, r);
+}
+
+int mpc_parse_contents_with(const char *filename, mpc_parser_t *p, mpc_pool_t *pool, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
+  char *string = NULL;
+  size_t length = 0, slots = 0;
   int res;
   
   if (f == NULL) {
@@ -1289,8 +2243,26 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
+  /* Read it all in so that the string fast paths apply */
+  while (!feof(f) && !ferror(f)) {
+    if (length + 4096 > slots) {
+      slots = slots ? slots * 2 : 65536;
+      string = realloc(string, slots);
+    }
+    length += fread(string + length, 1, 4096, f);
+  }
+  
+  if (ferror(f)) {
+    free(string);
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to read file!");
+    fclose(f);
+    return 0;
+  }
   fclose(f);
+  
+  res = mpc_nparse_with(filename, string ? string : "", length, p, pool, r);
+  free(string);
   return res;
 }
 
@@ -1358,6 +2330,8 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA: mpc_dfa_delete(p->data.dfa.d); break;
+    
     default: break;
   }
   
@@ -1395,14 +2369,26 @@ static mpc_parser_t *mpc_undefined(void) {
   return p;
 }
 
+/*
+** Named parsers get a small integer id which is
+** stored on the AST nodes they tag, so readers can
+** compare ids rather than search the tag strings.
+** Zero means no named parser.
+*/
+
+static int mpc_id_next = 1;
+
 mpc_parser_t *mpc_new(const char *name) {
   mpc_parser_t *p = mpc_undefined();
   p->retained = 1;
+  p->id = mpc_id_next++;
   p->name = realloc(p->name, strlen(name) + 1);
   strcpy(p->name, name);
   return p;
 }
 
+int mpc_id(mpc_parser_t *p) { return p->id; }
+
 mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   int i = 0;
   mpc_parser_t *p;
@@ -1411,6 +2397,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   
   p = mpc_undefined();
   p->retained = a->retained;
+  p->id = a->id;
   p->type = a->type;
   p->data = a->data;
   
@@ -1471,6 +2458,8 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       }
     break;
     
+    case MPC_TYPE_DFA: p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d); break;
+    
     default: break;
   }
 
@@ -1846,8 +2835,8 @@ static int mpc_boundary_anchor(char prev, char next) {
 mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
 
 mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { mpc_parser_t *p = mpc_undefined(); p->type = MPC_TYPE_SPACES; return mpc_expect(p, "spaces"); }
+mpc_parser_t *mpc_blank(void) { mpc_parser_t *p = mpc_undefined(); p->type = MPC_TYPE_BLANK; return mpc_expect(p, "whitespace"); }
 
 mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
 mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
@@ -2124,40 +3113,640 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
         range[strlen(range) + 1] = '\0';
         range[strlen(range) + 0] = s[i+1];      
       }
-      i++;
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
+  
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  
+  free(x);
+  free(range);
+  
+  return out;
+}
+
+/*
+** Regex DFA Compiler
+*/
+
+/*
+** Before building combinators `mpc_re` tries to
+** compile the regex straight to a DFA. The regex is
+** parsed with the same grammar as above and turned
+** into a DFA using the followpos construction over
+** its character set leaves.
+**
+** The combinators match like a PEG: repetition is
+** greedy and never gives characters back, and `|`
+** commits to the first alternative that matches.
+** A DFA instead finds the longest match. The two
+** only agree when every choice in the regex can be
+** made by looking at the next character, so a regex
+** is only compiled if
+**
+**   - alternatives other than the last can't be
+**     empty and don't share a first character with
+**     later alternatives,
+**   - repeated and optional parts can't be empty
+**     and don't share a first character with what
+**     may follow them.
+**
+** Anchors, boundaries, lookahead escapes such as
+** `\D` and anything else not covered fall back to
+** the combinator implementation.
+*/
+
+enum {
+  MPC_RE_SET   = 0,
+  MPC_RE_EMPTY = 1,
+  MPC_RE_CAT   = 2,
+  MPC_RE_ALT   = 3,
+  MPC_RE_STAR  = 4,
+  MPC_RE_PLUS  = 5,
+  MPC_RE_OPT   = 6
+};
+
+enum {
+  MPC_RE_POS_MAX    = 2048,
+  MPC_RE_STATES_MAX = 1024
+};
+
+typedef struct { unsigned char x[32]; } mpc_re_set_t;
+
+typedef struct {
+  int type;
+  int l, r;
+  int pos;
+  int nullable;
+  mpc_re_set_t first;
+} mpc_re_node_t;
+
+typedef struct {
+  const char *s;
+  int failed;
+  int nodes_num;
+  mpc_re_node_t *nodes;
+  int pos_num;
+  mpc_re_set_t *pos_sets;
+} mpc_re_st_t;
+
+static void mpc_re_set_add(mpc_re_set_t *s, int c) { s->x[(c & 0xFF) >> 3] |= (unsigned char)(1 << (c & 7)); }
+static int mpc_re_set_has(mpc_re_set_t *s, int c) { return (s->x[(c & 0xFF) >> 3] >> (c & 7)) & 1; }
+
+static void mpc_re_set_union(mpc_re_set_t *s, mpc_re_set_t *t) {
+  int j;
+  for (j = 0; j < 32; j++) { s->x[j] |= t->x[j]; }
+}
+
+static int mpc_re_set_disjoint(mpc_re_set_t *s, mpc_re_set_t *t) {
+  int j;
+  for (j = 0; j < 32; j++) { if (s->x[j] & t->x[j]) { return 0; } }
+  return 1;
+}
+
+static int mpc_re_node(mpc_re_st_t *st, int type, int l, int r) {
+  mpc_re_node_t *n;
+  st->nodes = realloc(st->nodes, sizeof(mpc_re_node_t) * (st->nodes_num + 1));
+  n = &st->nodes[st->nodes_num];
+  memset(n, 0, sizeof(mpc_re_node_t));
+  n->type = type;
+  n->l = l;
+  n->r = r;
+  n->pos = -1;
+  return st->nodes_num++;
+}
+
+static int mpc_re_leaf(mpc_re_st_t *st, mpc_re_set_t *set) {
+  int n;
+  if (st->pos_num >= MPC_RE_POS_MAX) { st->failed = 1; return mpc_re_node(st, MPC_RE_EMPTY, -1, -1); }
+  n = mpc_re_node(st, MPC_RE_SET, -1, -1);
+  st->pos_sets = realloc(st->pos_sets, sizeof(mpc_re_set_t) * (st->pos_num + 1));
+  st->pos_sets[st->pos_num] = *set;
+  /* The end of the input is never part of a match */
+  st->pos_sets[st->pos_num].x[0] &= 0xFE;
+  st->nodes[n].pos = st->pos_num++;
+  return n;
+}
+
+static int mpc_re_leaf_chars(mpc_re_st_t *st, const char *cs) {
+  mpc_re_set_t set;
+  memset(&set, 0, sizeof(set));
+  while (*cs) { mpc_re_set_add(&set, (unsigned char)*cs); cs++; }
+  return mpc_re_leaf(st, &set);
+}
+
+static int mpc_re_clone(mpc_re_st_t *st, int n) {
+  int l, r, m;
+  mpc_re_set_t set;
+  if (n == -1) { return -1; }
+  if (st->nodes[n].type == MPC_RE_SET) {
+    set = st->pos_sets[st->nodes[n].pos];
+    return mpc_re_leaf(st, &set);
+  }
+  l = mpc_re_clone(st, st->nodes[n].l);
+  r = mpc_re_clone(st, st->nodes[n].r);
+  m = mpc_re_node(st, st->nodes[n].type, l, r);
+  return m;
+}
+
+/* Same expansion of a range body as `mpcf_re_range` */
+static int mpc_re_parse_range(mpc_re_st_t *st, const char *s, size_t len) {
+  
+  size_t i;
+  int j, start, end;
+  const char *tmp;
+  mpc_re_set_t set, out;
+  int comp = s[0] == '^' ? 1 : 0;
+  
+  if (len == 0 || (comp && len == 1)) { st->failed = 1; return mpc_re_node(st, MPC_RE_EMPTY, -1, -1); }
+  
+  memset(&set, 0, sizeof(set));
+  
+  for (i = comp; i < len; i++) {
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        while (*tmp) { mpc_re_set_add(&set, (unsigned char)*tmp); tmp++; }
+      } else {
+        mpc_re_set_add(&set, (unsigned char)s[i+1]);
+      }
+      i++;
+    } else if (s[i] == '-') {
+      if (i+1 == len || i == 0) {
+        mpc_re_set_add(&set, '-');
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) { mpc_re_set_add(&set, j); }
+      }
+    } else {
+      mpc_re_set_add(&set, (unsigned char)s[i]);
+    }
+  }
+  
+  if (comp) {
+    for (j = 0; j < 32; j++) { out.x[j] = (unsigned char)~set.x[j]; }
+    return mpc_re_leaf(st, &out);
+  }
+  return mpc_re_leaf(st, &set);
+}
+
+static int mpc_re_parse_regex(mpc_re_st_t *st);
+
+static int mpc_re_parse_base(mpc_re_st_t *st) {
+  
+  int n;
+  size_t len;
+  const char *start;
+  mpc_re_set_t set;
+  char c = *st->s;
+  
+  if (c == '(') {
+    st->s++;
+    n = mpc_re_parse_regex(st);
+    if (*st->s != ')') { st->failed = 1; return n; }
+    st->s++;
+    return n;
+  }
+  
+  if (c == '[') {
+    start = ++st->s;
+    while (*st->s && *st->s != ']') {
+      if (*st->s == '\\') {
+        if (!st->s[1]) { st->failed = 1; return -1; }
+        st->s++;
+      }
+      st->s++;
+    }
+    if (*st->s != ']') { st->failed = 1; return -1; }
+    len = (size_t)(st->s - start);
+    st->s++;
+    {
+      char *body = malloc(len + 1);
+      memcpy(body, start, len);
+      body[len] = '\0';
+      n = mpc_re_parse_range(st, body, len);
+      free(body);
+    }
+    return n;
+  }
+  
+  if (c == '\\') {
+    c = st->s[1];
+    if (c == '\0') { st->failed = 1; return -1; }
+    st->s += 2;
+    switch (c) {
+      case 'a': return mpc_re_leaf_chars(st, "\a");
+      case 'f': return mpc_re_leaf_chars(st, "\f");
+      case 'n': return mpc_re_leaf_chars(st, "\n");
+      case 'r': return mpc_re_leaf_chars(st, "\r");
+      case 't': return mpc_re_leaf_chars(st, "\t");
+      case 'v': return mpc_re_leaf_chars(st, "\v");
+      case 'd': return mpc_re_leaf_chars(st, "0123456789");
+      case 's': return mpc_re_leaf_chars(st, " \f\n\r\t\v");
+      case 'w': return mpc_re_leaf_chars(st,
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_");
+      case 'b': case 'B': case 'A': case 'Z':
+      case 'D': case 'S': case 'W':
+        st->failed = 1; return -1;
+      default:
+        memset(&set, 0, sizeof(set));
+        mpc_re_set_add(&set, (unsigned char)c);
+        return mpc_re_leaf(st, &set);
+    }
+  }
+  
+  if (c == '\0' || c == ')' || c == '|') { st->failed = 1; return -1; }
+  
+  st->s++;
+  if (c == '^' || c == '$') { st->failed = 1; return -1; }
+  if (c == '.') {
+    memset(&set, 0xFF, sizeof(set));
+    return mpc_re_leaf(st, &set);
+  }
+  
+  memset(&set, 0, sizeof(set));
+  mpc_re_set_add(&set, (unsigned char)c);
+  return mpc_re_leaf(st, &set);
+}
+
+static int mpc_re_parse_factor(mpc_re_st_t *st) {
+  
+  int n, m, k, num;
+  n = mpc_re_parse_base(st);
+  if (st->failed) { return n; }
+  
+  switch (*st->s) {
+    case '*': st->s++; return mpc_re_node(st, MPC_RE_STAR, n, -1);
+    case '+': st->s++; return mpc_re_node(st, MPC_RE_PLUS, n, -1);
+    case '?': st->s++; return mpc_re_node(st, MPC_RE_OPT,  n, -1);
+    case '{':
+      if (!isdigit((unsigned char)st->s[1])) { st->failed = 1; return n; }
+      num = (int)strtol(st->s + 1, (char**)&st->s, 10);
+      if (*st->s != '}' || num > 64) { st->failed = 1; return n; }
+      st->s++;
+      if (num == 0) { return mpc_re_node(st, MPC_RE_EMPTY, -1, -1); }
+      m = n;
+      for (k = 1; k < num; k++) {
+        m = mpc_re_node(st, MPC_RE_CAT, m, mpc_re_clone(st, n));
+      }
+      return m;
+    default: return n;
+  }
+}
+
+static int mpc_re_parse_term(mpc_re_st_t *st) {
+  int n = -1;
+  while (!st->failed && *st->s && *st->s != ')' && *st->s != '|') {
+    n = n == -1
+      ? mpc_re_parse_factor(st)
+      : mpc_re_node(st, MPC_RE_CAT, n, mpc_re_parse_factor(st));
+  }
+  return n == -1 ? mpc_re_node(st, MPC_RE_EMPTY, -1, -1) : n;
+}
+
+static int mpc_re_parse_regex(mpc_re_st_t *st) {
+  int n = mpc_re_parse_term(st);
+  if (!st->failed && *st->s == '|') {
+    st->s++;
+    return mpc_re_node(st, MPC_RE_ALT, n, mpc_re_parse_regex(st));
+  }
+  return n;
+}
+
+/* Computes `nullable` and first characters */
+static void mpc_re_analyse(mpc_re_st_t *st, int n) {
+  
+  mpc_re_node_t *x = &st->nodes[n];
+  mpc_re_node_t *l, *r;
+  
+  if (x->l != -1) { mpc_re_analyse(st, x->l); }
+  if (x->r != -1) { mpc_re_analyse(st, x->r); }
+  
+  x = &st->nodes[n];
+  l = x->l != -1 ? &st->nodes[x->l] : NULL;
+  r = x->r != -1 ? &st->nodes[x->r] : NULL;
+  memset(&x->first, 0, sizeof(x->first));
+  
+  switch (x->type) {
+    case MPC_RE_SET: x->nullable = 0; x->first = st->pos_sets[x->pos]; break;
+    case MPC_RE_EMPTY: x->nullable = 1; break;
+    case MPC_RE_CAT:
+      x->nullable = l->nullable && r->nullable;
+      x->first = l->first;
+      if (l->nullable) { mpc_re_set_union(&x->first, &r->first); }
+    break;
+    case MPC_RE_ALT:
+      x->nullable = l->nullable || r->nullable;
+      x->first = l->first;
+      mpc_re_set_union(&x->first, &r->first);
+    break;
+    case MPC_RE_STAR:
+    case MPC_RE_OPT:
+      x->nullable = 1; x->first = l->first;
+    break;
+    case MPC_RE_PLUS: x->nullable = l->nullable; x->first = l->first; break;
+  }
+}
+
+/* Checks the choices in `n` can all be made on one character of lookahead */
+static int mpc_re_deterministic(mpc_re_st_t *st, int n, mpc_re_set_t *follow) {
+  
+  mpc_re_node_t *x = &st->nodes[n];
+  mpc_re_node_t *l = x->l != -1 ? &st->nodes[x->l] : NULL;
+  mpc_re_node_t *r = x->r != -1 ? &st->nodes[x->r] : NULL;
+  mpc_re_set_t f;
+  
+  switch (x->type) {
+    case MPC_RE_SET:
+    case MPC_RE_EMPTY:
+      return 1;
+    case MPC_RE_CAT:
+      f = r->first;
+      if (r->nullable) { mpc_re_set_union(&f, follow); }
+      return mpc_re_deterministic(st, x->l, &f)
+          && mpc_re_deterministic(st, x->r, follow);
+    case MPC_RE_ALT:
+      if (l->nullable) { return 0; }
+      if (!mpc_re_set_disjoint(&l->first, &r->first)) { return 0; }
+      if (r->nullable && !mpc_re_set_disjoint(&l->first, follow)) { return 0; }
+      return mpc_re_deterministic(st, x->l, follow)
+          && mpc_re_deterministic(st, x->r, follow);
+    case MPC_RE_STAR:
+    case MPC_RE_PLUS:
+    case MPC_RE_OPT:
+      if (l->nullable) { return 0; }
+      if (!mpc_re_set_disjoint(&l->first, follow)) { return 0; }
+      f = *follow;
+      if (x->type != MPC_RE_OPT) { mpc_re_set_union(&f, &l->first); }
+      return mpc_re_deterministic(st, x->l, &f);
+  }
+  return 0;
+}
+
+/* Sets of positions are bitsets of `words` words */
+typedef unsigned long mpc_re_bits_t;
+
+#define MPC_RE_BITS ((int)(sizeof(mpc_re_bits_t) * 8))
+
+static void mpc_re_bits_add(mpc_re_bits_t *b, int p) { b[p / MPC_RE_BITS] |= (mpc_re_bits_t)1 << (p % MPC_RE_BITS); }
+static int mpc_re_bits_has(mpc_re_bits_t *b, int p) { return (int)((b[p / MPC_RE_BITS] >> (p % MPC_RE_BITS)) & 1); }
+
+static void mpc_re_bits_union(mpc_re_bits_t *b, mpc_re_bits_t *c, int words) {
+  int j;
+  for (j = 0; j < words; j++) { b[j] |= c[j]; }
+}
+
+/* Computes first and last positions and adds to followpos */
+static void mpc_re_positions(mpc_re_st_t *st, int n, int words,
+  mpc_re_bits_t *first, mpc_re_bits_t *last, mpc_re_bits_t *follow) {
+  
+  int p;
+  mpc_re_node_t *x = &st->nodes[n];
+  mpc_re_bits_t *lf = NULL, *ll = NULL, *rf = NULL, *rl = NULL;
+  mpc_re_bits_t *nf = first + (size_t)n * words, *nl = last + (size_t)n * words;
+  
+  /* A missing child (-1) has no sets, so no pointer is formed for it */
+  if (x->l >= 0) {
+    lf = first + (size_t)x->l * words; ll = last + (size_t)x->l * words;
+    mpc_re_positions(st, x->l, words, first, last, follow);
+  }
+  if (x->r >= 0) {
+    rf = first + (size_t)x->r * words; rl = last + (size_t)x->r * words;
+    mpc_re_positions(st, x->r, words, first, last, follow);
+  }
+  
+  switch (x->type) {
+    case MPC_RE_SET:
+      mpc_re_bits_add(nf, x->pos);
+      mpc_re_bits_add(nl, x->pos);
+    break;
+    case MPC_RE_EMPTY: break;
+    case MPC_RE_CAT:
+      mpc_re_bits_union(nf, lf, words);
+      if (st->nodes[x->l].nullable) { mpc_re_bits_union(nf, rf, words); }
+      mpc_re_bits_union(nl, rl, words);
+      if (st->nodes[x->r].nullable) { mpc_re_bits_union(nl, ll, words); }
+      for (p = 0; p < st->pos_num; p++) {
+        if (mpc_re_bits_has(ll, p)) { mpc_re_bits_union(follow + (size_t)p * words, rf, words); }
+      }
+    break;
+    case MPC_RE_ALT:
+      mpc_re_bits_union(nf, lf, words); mpc_re_bits_union(nf, rf, words);
+      mpc_re_bits_union(nl, ll, words); mpc_re_bits_union(nl, rl, words);
+    break;
+    case MPC_RE_STAR:
+    case MPC_RE_PLUS:
+      mpc_re_bits_union(nf, lf, words);
+      mpc_re_bits_union(nl, ll, words);
+      for (p = 0; p < st->pos_num; p++) {
+        if (mpc_re_bits_has(nl, p)) { mpc_re_bits_union(follow + (size_t)p * words, nf, words); }
+      }
+    break;
+    case MPC_RE_OPT:
+      mpc_re_bits_union(nf, lf, words);
+      mpc_re_bits_union(nl, ll, words);
+    break;
+  }
+}
+
+/*
+** States which loop on themselves for all but a few
+** bytes, such as inside a comment or a string, or on
+** only a few bytes, such as in a run of whitespace,
+** get a scan set so matching can skip over the loop.
+*/
+
+static void mpc_re_dfa_scans(mpc_dfa_t *d) {
+  
+  int s, c, in_num, out_num;
+  char in[256], out[256];
+  
+  d->scan = malloc(sizeof(int) * d->states_num);
+  d->scans = malloc(sizeof(mpc_scan_set_t));
+  d->scans_num = 0;
+  
+  for (s = 0; s < d->states_num; s++) {
+    
+    in_num = 0; out_num = 0;
+    for (c = 1; c < 256; c++) {
+      if (d->trans[s * d->classes_num + d->classes[c]] == s) {
+        in[in_num++] = (char)c;
+      } else {
+        out[out_num++] = (char)c;
+      }
+    }
+    
+    d->scan[s] = -1;
+    if (in_num == 0) { continue; }
+    if (out_num > MPC_SCAN_SET_MAX && in_num > MPC_SCAN_SET_MAX) { continue; }
+    
+    d->scans = realloc(d->scans, sizeof(mpc_scan_set_t) * (d->scans_num + 1));
+    if (out_num <= MPC_SCAN_SET_MAX) {
+      mpc_scan_set_init(&d->scans[d->scans_num], out, out_num, 0);
+    } else {
+      mpc_scan_set_init(&d->scans[d->scans_num], in, in_num, 1);
+    }
+    d->scan[s] = d->scans_num++;
+  }
+  
+}
+
+static mpc_dfa_t *mpc_re_dfa_build(mpc_re_st_t *st, int root, const char *re) {
+  
+  int words, end, c, k, p, s, t;
+  int classes_num = 0;
+  int states_num = 0, states_slots = 16;
+  int class_rep[256];
+  mpc_re_bits_t *first, *last, *follow, *states, *next;
+  mpc_dfa_t *d;
+  
+  /* Mark the end of a match with an extra position */
+  end = st->pos_num++;
+  words = (st->pos_num + MPC_RE_BITS - 1) / MPC_RE_BITS;
+  
+  first = calloc((size_t)st->nodes_num * words, sizeof(mpc_re_bits_t));
+  last = calloc((size_t)st->nodes_num * words, sizeof(mpc_re_bits_t));
+  follow = calloc((size_t)st->pos_num * words, sizeof(mpc_re_bits_t));
+  mpc_re_positions(st, root, words, first, last, follow);
+  
+  for (p = 0; p < end; p++) {
+    if (mpc_re_bits_has(last + (size_t)root * words, p)) { mpc_re_bits_add(follow + (size_t)p * words, end); }
+  }
+  
+  d = malloc(sizeof(mpc_dfa_t));
+  
+  /* Bytes which belong to exactly the same positions share a class */
+  for (c = 0; c < 256; c++) {
+    for (k = 0; k < classes_num; k++) {
+      for (p = 0; p < end; p++) {
+        if (mpc_re_set_has(&st->pos_sets[p], c) != mpc_re_set_has(&st->pos_sets[p], class_rep[k])) { break; }
+      }
+      if (p == end) { break; }
     }
+    if (k == classes_num) { class_rep[classes_num++] = c; }
+    d->classes[c] = (unsigned char)k;
+  }
+  
+  states = malloc(sizeof(mpc_re_bits_t) * words * states_slots);
+  memcpy(states, first + (size_t)root * words, sizeof(mpc_re_bits_t) * words);
+  if (st->nodes[root].nullable) { mpc_re_bits_add(states, end); }
+  states_num = 1;
+  
+  d->classes_num = classes_num;
+  d->trans = malloc(sizeof(int) * classes_num * states_slots);
+  d->accept = malloc(states_slots);
+  next = malloc(sizeof(mpc_re_bits_t) * words);
+  
+  for (s = 0; s < states_num; s++) {
     
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
-        }        
-      }
-    }
+    d->accept[s] = (char)mpc_re_bits_has(states + (size_t)s * words, end);
     
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+    for (k = 0; k < classes_num; k++) {
+      
+      memset(next, 0, sizeof(mpc_re_bits_t) * words);
+      for (p = 0; p < end; p++) {
+        if (mpc_re_bits_has(states + (size_t)s * words, p)
+        &&  mpc_re_set_has(&st->pos_sets[p], class_rep[k])) {
+          mpc_re_bits_union(next, follow + (size_t)p * words, words);
+        }
+      }
+      
+      for (p = 0; p < words; p++) { if (next[p]) { break; } }
+      if (p == words) { d->trans[s * classes_num + k] = -1; continue; }
+      
+      for (t = 0; t < states_num; t++) {
+        if (memcmp(states + (size_t)t * words, next, sizeof(mpc_re_bits_t) * words) == 0) { break; }
+      }
+      
+      if (t == states_num) {
+        if (states_num == MPC_RE_STATES_MAX) {
+          free(first); free(last); free(follow); free(states); free(next);
+          free(d->trans); free(d->accept); free(d);
+          return NULL;
+        }
+        if (states_num == states_slots) {
+          states_slots *= 2;
+          states = realloc(states, sizeof(mpc_re_bits_t) * words * states_slots);
+          d->trans = realloc(d->trans, sizeof(int) * classes_num * states_slots);
+          d->accept = realloc(d->accept, states_slots);
+        }
+        memcpy(states + (size_t)t * words, next, sizeof(mpc_re_bits_t) * words);
+        states_num++;
+      }
+      
+      d->trans[s * classes_num + k] = t;
     }
+  }
+  
+  d->states_num = states_num;
+  d->start = 0;
+  mpc_re_dfa_scans(d);
+  d->re = malloc(strlen(re) + 1);
+  strcpy(d->re, re);
   
+  free(first); free(last); free(follow); free(states); free(next);
+  return d;
+}
+
+static mpc_parser_t *mpc_re_dfa(const char *re) {
+  
+  int root;
+  mpc_re_set_t follow;
+  mpc_re_st_t st;
+  mpc_dfa_t *d = NULL;
+  mpc_parser_t *p;
+  
+  st.s = re;
+  st.failed = 0;
+  st.nodes_num = 0;
+  st.nodes = NULL;
+  st.pos_num = 0;
+  st.pos_sets = NULL;
+  
+  root = mpc_re_parse_regex(&st);
+  
+  if (!st.failed && *st.s == '\0') {
+    memset(&follow, 0, sizeof(follow));
+    mpc_re_analyse(&st, root);
+    if (mpc_re_deterministic(&st, root, &follow)) {
+      d = mpc_re_dfa_build(&st, root, re);
+    }
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  free(st.nodes);
+  free(st.pos_sets);
   
-  free(x);
-  free(range);
+  if (d == NULL) { return NULL; }
   
-  return out;
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.d = d;
+  return p;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2166,6 +3755,9 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_parser_t *err_out;
   mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  mpc_parser_t *dfa = mpc_re_dfa(re);
+  
+  if (dfa) { return dfa; }
   
   Regex  = mpc_new("regex");
   Term   = mpc_new("term");
@@ -2510,6 +4102,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   }
   
   if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_SPACES) { printf("<s>"); }
+  if (p->type == MPC_TYPE_BLANK) { printf("<_>"); }
   if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
 
   if (p->type == MPC_TYPE_SINGLE) {
@@ -2565,6 +4159,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_DFA) { printf("/%s/", p->data.dfa.d->re); }
+  
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
@@ -2690,6 +4286,25 @@ void mpc_ast_delete(mpc_ast_t *a) {
   
 }
 
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *r;
+  
+  if (a == NULL) { return a; }
+  
+  r = mpc_ast_new(a->tag, a->contents);
+  r->tag_id = a->tag_id;
+  r->state = a->state;
+  r->children_num = a->children_num;
+  r->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  
+  return r;
+}
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
@@ -2704,6 +4319,8 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   a->tag = malloc(strlen(tag) + 1);
   strcpy(a->tag, tag);
   
+  a->tag_id = 0;
+  
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
   
@@ -3020,6 +4637,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
       mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      if (!as[i]->children[0]->tag_id) { as[i]->children[0]->tag_id = as[i]->tag_id; }
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
@@ -3064,6 +4682,17 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
   return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
 }
 
+/* Tags with the name and, if it has none yet, the id of `p` */
+static mpc_ast_t *mpc_ast_add_parser_tag(mpc_ast_t *a, mpc_parser_t *p) {
+  a = mpc_ast_add_tag(a, p->name);
+  if (a && a->tag_id == 0) { a->tag_id = p->id; }
+  return a;
+}
+
+static mpc_parser_t *mpca_add_parser_tag(mpc_parser_t *a) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_parser_tag, a);
+}
+
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
@@ -3292,7 +4921,7 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   free(x);
 
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    return mpca_state(mpca_root(mpca_add_parser_tag(p)));
   } else {
     return mpca_state(mpca_root(p));
   }
@@ -3439,6 +5068,8 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
+    if (st->flags & MPCA_LANG_MEMOISE) { left->memo = 1; }
+    if (st->flags & MPCA_LANG_LAZY_ERRORS) { left->lazy = 1; }
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
@@ -3624,6 +5255,469 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   return err;
 }
 
+/*
+** Grammar Tables
+*/
+
+/*
+** Building a grammar with `mpca_lang` means parsing
+** the grammar itself and compiling every regex in it,
+** which is wasted work if the grammar never changes.
+** `mpca_table_write` instead writes a set of parsers
+** out as a C array of bytes, which can be generated
+** once at build time and compiled in. `mpca_table_load`
+** then rebuilds the parsers from it directly.
+**
+** The parsers are written as a flat list of nodes,
+** starting with the ones passed in, with children
+** referred to by their position in the list. Callback
+** functions are written as their position in the
+** table below, so only parsers built from the
+** functions mpc itself provides can be written out.
+** That covers anything made with `mpca_lang`.
+**
+** Tag strings are used straight out of the table, so
+** a table must outlive any parsers loaded from it.
+** This is no problem for a static array.
+*/
+
+typedef void (*mpc_table_fn_t)(void);
+
+static const mpc_table_fn_t mpc_table_fns[] = {
+  NULL,
+  (mpc_table_fn_t)free,
+  (mpc_table_fn_t)mpcf_dtor_null,
+  (mpc_table_fn_t)mpcf_ctor_null,
+  (mpc_table_fn_t)mpcf_ctor_str,
+  (mpc_table_fn_t)mpcf_free,
+  (mpc_table_fn_t)mpcf_int,
+  (mpc_table_fn_t)mpcf_hex,
+  (mpc_table_fn_t)mpcf_oct,
+  (mpc_table_fn_t)mpcf_float,
+  (mpc_table_fn_t)mpcf_strtriml,
+  (mpc_table_fn_t)mpcf_strtrimr,
+  (mpc_table_fn_t)mpcf_strtrim,
+  (mpc_table_fn_t)mpcf_escape,
+  (mpc_table_fn_t)mpcf_escape_regex,
+  (mpc_table_fn_t)mpcf_escape_string_raw,
+  (mpc_table_fn_t)mpcf_escape_char_raw,
+  (mpc_table_fn_t)mpcf_unescape,
+  (mpc_table_fn_t)mpcf_unescape_regex,
+  (mpc_table_fn_t)mpcf_unescape_string_raw,
+  (mpc_table_fn_t)mpcf_unescape_char_raw,
+  (mpc_table_fn_t)mpcf_null,
+  (mpc_table_fn_t)mpcf_fst,
+  (mpc_table_fn_t)mpcf_snd,
+  (mpc_table_fn_t)mpcf_trd,
+  (mpc_table_fn_t)mpcf_fst_free,
+  (mpc_table_fn_t)mpcf_snd_free,
+  (mpc_table_fn_t)mpcf_trd_free,
+  (mpc_table_fn_t)mpcf_strfold,
+  (mpc_table_fn_t)mpcf_maths,
+  (mpc_table_fn_t)mpcf_fold_ast,
+  (mpc_table_fn_t)mpcf_str_ast,
+  (mpc_table_fn_t)mpcf_state_ast,
+  (mpc_table_fn_t)mpc_ast_delete,
+  (mpc_table_fn_t)mpc_ast_tag,
+  (mpc_table_fn_t)mpc_ast_add_tag,
+  (mpc_table_fn_t)mpc_ast_add_root,
+  (mpc_table_fn_t)mpc_ast_add_parser_tag,
+  (mpc_table_fn_t)mpc_soi_anchor,
+  (mpc_table_fn_t)mpc_eoi_anchor,
+  (mpc_table_fn_t)mpc_boundary_anchor,
+  (mpc_table_fn_t)mpc_soft_delete
+};
+
+enum {
+  MPC_TABLE_VERSION = 1,
+  MPC_TABLE_FNS_NUM = sizeof(mpc_table_fns) / sizeof(mpc_table_fn_t)
+};
+
+typedef struct {
+  unsigned char *data;
+  long size;
+  long slots;
+  int nodes_num;
+  mpc_parser_t **nodes;
+  int failed;
+} mpc_table_out_t;
+
+typedef struct {
+  const unsigned char *data;
+  long pos;
+  int nodes_num;
+  mpc_parser_t **nodes;
+} mpc_table_in_t;
+
+static void mpc_table_put_byte(mpc_table_out_t *t, int x) {
+  if (t->size == t->slots) {
+    t->slots = t->slots ? t->slots * 2 : 1024;
+    t->data = realloc(t->data, t->slots);
+  }
+  t->data[t->size++] = (unsigned char)x;
+}
+
+static void mpc_table_put_int(mpc_table_out_t *t, int x) {
+  int j;
+  for (j = 0; j < 4; j++) { mpc_table_put_byte(t, ((unsigned int)x >> (8 * j)) & 0xFF); }
+}
+
+static void mpc_table_put_str(mpc_table_out_t *t, const char *s) {
+  size_t j, n = strlen(s);
+  mpc_table_put_int(t, (int)n);
+  for (j = 0; j <= n; j++) { mpc_table_put_byte(t, s[j]); }
+}
+
+static void mpc_table_put_fn(mpc_table_out_t *t, mpc_table_fn_t f) {
+  int j;
+  for (j = 0; j < MPC_TABLE_FNS_NUM; j++) {
+    if (mpc_table_fns[j] == f) { mpc_table_put_int(t, j); return; }
+  }
+  t->failed = 1;
+}
+
+static void mpc_table_put_node(mpc_table_out_t *t, mpc_parser_t *p) {
+  int j;
+  for (j = 0; j < t->nodes_num; j++) {
+    if (t->nodes[j] == p) { mpc_table_put_int(t, j); return; }
+  }
+  /* Named parsers must be among those passed in */
+  if (p->retained) { t->failed = 1; }
+  t->nodes = realloc(t->nodes, sizeof(mpc_parser_t*) * (t->nodes_num + 1));
+  t->nodes[t->nodes_num] = p;
+  mpc_table_put_int(t, t->nodes_num++);
+}
+
+static void mpc_table_put_parser(mpc_table_out_t *t, mpc_parser_t *p) {
+  
+  int j;
+  mpc_dfa_t *d;
+  
+  mpc_table_put_byte(t, p->type);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: mpc_table_put_str(t, p->data.fail.m); break;
+    case MPC_TYPE_LIFT: mpc_table_put_fn(t, (mpc_table_fn_t)p->data.lift.lf); break;
+    case MPC_TYPE_LIFT_VAL: t->failed = 1; break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_table_put_node(t, p->data.expect.x);
+      mpc_table_put_str(t, p->data.expect.m);
+      break;
+    
+    case MPC_TYPE_ANCHOR:  mpc_table_put_fn(t, (mpc_table_fn_t)p->data.anchor.f); break;
+    case MPC_TYPE_SATISFY: mpc_table_put_fn(t, (mpc_table_fn_t)p->data.satisfy.f); break;
+    case MPC_TYPE_SINGLE:  mpc_table_put_byte(t, p->data.single.x); break;
+    
+    case MPC_TYPE_RANGE:
+      mpc_table_put_byte(t, p->data.range.x);
+      mpc_table_put_byte(t, p->data.range.y);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      mpc_table_put_str(t, p->data.string.x);
+      break;
+    
+    case MPC_TYPE_APPLY:
+      mpc_table_put_node(t, p->data.apply.x);
+      mpc_table_put_fn(t, (mpc_table_fn_t)p->data.apply.f);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      mpc_table_put_node(t, p->data.apply_to.x);
+      mpc_table_put_fn(t, (mpc_table_fn_t)p->data.apply_to.f);
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+      ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        mpc_table_put_str(t, p->data.apply_to.d);
+      } else if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_parser_tag) {
+        mpc_table_put_node(t, p->data.apply_to.d);
+      } else {
+        t->failed = 1;
+      }
+      break;
+    
+    case MPC_TYPE_PREDICT: mpc_table_put_node(t, p->data.predict.x); break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_table_put_node(t, p->data.not.x);
+      mpc_table_put_fn(t, (mpc_table_fn_t)p->data.not.dx);
+      mpc_table_put_fn(t, (mpc_table_fn_t)p->data.not.lf);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_table_put_int(t, p->data.repeat.n);
+      mpc_table_put_fn(t, (mpc_table_fn_t)p->data.repeat.f);
+      mpc_table_put_node(t, p->data.repeat.x);
+      mpc_table_put_fn(t, (mpc_table_fn_t)p->data.repeat.dx);
+      break;
+    
+    case MPC_TYPE_OR:
+      mpc_table_put_int(t, p->data.or.n);
+      for (j = 0; j < p->data.or.n; j++) { mpc_table_put_node(t, p->data.or.xs[j]); }
+      break;
+    
+    case MPC_TYPE_AND:
+      mpc_table_put_int(t, p->data.and.n);
+      mpc_table_put_fn(t, (mpc_table_fn_t)p->data.and.f);
+      for (j = 0; j < p->data.and.n; j++) { mpc_table_put_node(t, p->data.and.xs[j]); }
+      for (j = 0; j < p->data.and.n-1; j++) { mpc_table_put_fn(t, (mpc_table_fn_t)p->data.and.dxs[j]); }
+      break;
+    
+    case MPC_TYPE_DFA:
+      d = p->data.dfa.d;
+      mpc_table_put_int(t, d->states_num);
+      mpc_table_put_int(t, d->classes_num);
+      mpc_table_put_int(t, d->start);
+      for (j = 0; j < 256; j++) { mpc_table_put_byte(t, d->classes[j]); }
+      for (j = 0; j < d->states_num * d->classes_num; j++) { mpc_table_put_int(t, d->trans[j]); }
+      for (j = 0; j < d->states_num; j++) { mpc_table_put_byte(t, d->accept[j]); }
+      mpc_table_put_str(t, d->re);
+      break;
+    
+    default: break;
+  }
+  
+}
+
+static int mpc_table_int(mpc_table_in_t *t) {
+  unsigned int x = 0;
+  int j;
+  for (j = 0; j < 4; j++) { x |= (unsigned int)t->data[t->pos++] << (8 * j); }
+  return (int)x;
+}
+
+static char mpc_table_byte(mpc_table_in_t *t) {
+  return (char)t->data[t->pos++];
+}
+
+static const char *mpc_table_str_ref(mpc_table_in_t *t) {
+  int n = mpc_table_int(t);
+  const char *s = (const char*)t->data + t->pos;
+  t->pos += n + 1;
+  return s;
+}
+
+static char *mpc_table_str(mpc_table_in_t *t) {
+  const char *s = mpc_table_str_ref(t);
+  char *x = malloc(strlen(s) + 1);
+  strcpy(x, s);
+  return x;
+}
+
+static mpc_table_fn_t mpc_table_fn(mpc_table_in_t *t) {
+  return mpc_table_fns[mpc_table_int(t)];
+}
+
+static mpc_parser_t *mpc_table_node(mpc_table_in_t *t) {
+  return t->nodes[mpc_table_int(t)];
+}
+
+static void mpc_table_parser(mpc_table_in_t *t, mpc_parser_t *p) {
+  
+  int j;
+  mpc_dfa_t *d;
+  
+  p->type = mpc_table_byte(t);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: p->data.fail.m = mpc_table_str(t); break;
+    case MPC_TYPE_LIFT: p->data.lift.lf = (mpc_ctor_t)mpc_table_fn(t); break;
+    
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_table_node(t);
+      p->data.expect.m = mpc_table_str(t);
+      break;
+    
+    case MPC_TYPE_ANCHOR:  p->data.anchor.f = (int(*)(char,char))mpc_table_fn(t); break;
+    case MPC_TYPE_SATISFY: p->data.satisfy.f = (int(*)(char))mpc_table_fn(t); break;
+    case MPC_TYPE_SINGLE:  p->data.single.x = mpc_table_byte(t); break;
+    
+    case MPC_TYPE_RANGE:
+      p->data.range.x = mpc_table_byte(t);
+      p->data.range.y = mpc_table_byte(t);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = mpc_table_str(t);
+      break;
+    
+    case MPC_TYPE_APPLY:
+      p->data.apply.x = mpc_table_node(t);
+      p->data.apply.f = (mpc_apply_t)mpc_table_fn(t);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      p->data.apply_to.x = mpc_table_node(t);
+      p->data.apply_to.f = (mpc_apply_to_t)mpc_table_fn(t);
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_parser_tag) {
+        p->data.apply_to.d = mpc_table_node(t);
+      } else {
+        p->data.apply_to.d = (void*)mpc_table_str_ref(t);
+      }
+      break;
+    
+    case MPC_TYPE_PREDICT: p->data.predict.x = mpc_table_node(t); break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      p->data.not.x = mpc_table_node(t);
+      p->data.not.dx = (mpc_dtor_t)mpc_table_fn(t);
+      p->data.not.lf = (mpc_ctor_t)mpc_table_fn(t);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.n = mpc_table_int(t);
+      p->data.repeat.f = (mpc_fold_t)mpc_table_fn(t);
+      p->data.repeat.x = mpc_table_node(t);
+      p->data.repeat.dx = (mpc_dtor_t)mpc_table_fn(t);
+      break;
+    
+    case MPC_TYPE_OR:
+      p->data.or.n = mpc_table_int(t);
+      p->data.or.xs = malloc(sizeof(mpc_parser_t*) * p->data.or.n);
+      for (j = 0; j < p->data.or.n; j++) { p->data.or.xs[j] = mpc_table_node(t); }
+      break;
+    
+    case MPC_TYPE_AND:
+      p->data.and.n = mpc_table_int(t);
+      p->data.and.f = (mpc_fold_t)mpc_table_fn(t);
+      p->data.and.xs = malloc(sizeof(mpc_parser_t*) * p->data.and.n);
+      p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (p->data.and.n-1));
+      for (j = 0; j < p->data.and.n; j++) { p->data.and.xs[j] = mpc_table_node(t); }
+      for (j = 0; j < p->data.and.n-1; j++) { p->data.and.dxs[j] = (mpc_dtor_t)mpc_table_fn(t); }
+      break;
+    
+    case MPC_TYPE_DFA:
+      d = malloc(sizeof(mpc_dfa_t));
+      d->states_num = mpc_table_int(t);
+      d->classes_num = mpc_table_int(t);
+      d->start = mpc_table_int(t);
+      for (j = 0; j < 256; j++) { d->classes[j] = (unsigned char)mpc_table_byte(t); }
+      d->trans = malloc(sizeof(int) * d->states_num * d->classes_num);
+      for (j = 0; j < d->states_num * d->classes_num; j++) { d->trans[j] = mpc_table_int(t); }
+      d->accept = malloc(d->states_num);
+      for (j = 0; j < d->states_num; j++) { d->accept[j] = mpc_table_byte(t); }
+      d->re = mpc_table_str(t);
+      mpc_re_dfa_scans(d);
+      p->data.dfa.d = d;
+      break;
+    
+    default: break;
+  }
+  
+}
+
+static mpc_err_t *mpca_table_write_va(FILE *f, const char *name, int n, va_list va) {
+  
+  mpc_table_out_t t;
+  mpc_table_out_t h;
+  int i;
+  long j;
+  
+  t.data = NULL; t.size = 0; t.slots = 0; t.failed = 0;
+  t.nodes_num = n;
+  t.nodes = malloc(sizeof(mpc_parser_t*) * n);
+  for (i = 0; i < n; i++) { t.nodes[i] = va_arg(va, mpc_parser_t*); }
+  
+  /* Writing a node can add more nodes to the end of the list */
+  for (i = 0; i < t.nodes_num; i++) { mpc_table_put_parser(&t, t.nodes[i]); }
+  
+  if (t.failed) {
+    free(t.nodes);
+    free(t.data);
+    return mpc_err_file(name, "Parser uses a function or value which can't be written to a table!");
+  }
+  
+  h.data = NULL; h.size = 0; h.slots = 0; h.failed = 0;
+  mpc_table_put_byte(&h, 'M');
+  mpc_table_put_byte(&h, 'P');
+  mpc_table_put_byte(&h, 'C');
+  mpc_table_put_byte(&h, 'T');
+  mpc_table_put_int(&h, MPC_TABLE_VERSION);
+  mpc_table_put_int(&h, t.nodes_num);
+  mpc_table_put_int(&h, n);
+  for (i = 0; i < n; i++) { mpc_table_put_str(&h, t.nodes[i]->name ? t.nodes[i]->name : ""); }
+  
+  fprintf(f, "static const unsigned char %s[%ld] = {", name, h.size + t.size);
+  for (j = 0; j < h.size + t.size; j++) {
+    if (j % 16 == 0) { fprintf(f, "\n "); }
+    fprintf(f, " 0x%02x,", j < h.size ? h.data[j] : t.data[j - h.size]);
+  }
+  fprintf(f, "\n};\n");
+  
+  free(t.nodes);
+  free(t.data);
+  free(h.data);
+  return NULL;
+}
+
+mpc_err_t *mpca_table_write(FILE *f, const char *name, int n, ...) {
+  mpc_err_t *err;
+  va_list va;
+  va_start(va, n);
+  err = mpca_table_write_va(f, name, n, va);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_table_load(int flags, const unsigned char *table, int n, ...) {
+  
+  mpc_table_in_t t;
+  mpc_parser_t *p;
+  const char *name;
+  int i, roots_num;
+  va_list va;
+  
+  t.data = table;
+  t.pos = 0;
+  
+  if (memcmp(table, "MPCT", 4) != 0) { return mpc_err_file("<mpca_table>", "Not a grammar table!"); }
+  t.pos += 4;
+  if (mpc_table_int(&t) != MPC_TABLE_VERSION) {
+    return mpc_err_file("<mpca_table>", "Grammar table is from another version of mpc!");
+  }
+  
+  t.nodes_num = mpc_table_int(&t);
+  roots_num = mpc_table_int(&t);
+  if (roots_num != n) {
+    return mpc_err_file("<mpca_table>", "Grammar table has a different number of parsers!");
+  }
+  
+  t.nodes = malloc(sizeof(mpc_parser_t*) * t.nodes_num);
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p = va_arg(va, mpc_parser_t*);
+    name = mpc_table_str_ref(&t);
+    if (strcmp(name, p->name ? p->name : "") != 0) {
+      va_end(va);
+      free(t.nodes);
+      return mpc_err_file("<mpca_table>", "Grammar table has different parsers!");
+    }
+    if (flags & MPCA_LANG_MEMOISE) { p->memo = 1; }
+    if (flags & MPCA_LANG_LAZY_ERRORS) { p->lazy = 1; }
+    t.nodes[i] = p;
+  }
+  va_end(va);
+  
+  for (i = n; i < t.nodes_num; i++) { t.nodes[i] = mpc_undefined(); }
+  for (i = 0; i < t.nodes_num; i++) { mpc_table_parser(&t, t.nodes[i]); }
+  
+  free(t.nodes);
+  return NULL;
+}
+
 static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
   int i, total;
@@ -70,6 +70,26 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+struct mpc_pool_t;
+typedef struct mpc_pool_t mpc_pool_t;
+
+mpc_pool_t *mpc_pool_new(void);
+void mpc_pool_delete(mpc_pool_t *pool);
+
+typedef struct {
+  long allocs;
+  long overflows;
+  long overflow_bytes;
+  long chunks;
+  long capacity;
+} mpc_pool_stats_t;
+
+void mpc_pool_stats(mpc_pool_t *pool, mpc_pool_stats_t *s);
+
+int mpc_parse_with(const char *filename, const char *string, mpc_parser_t *p, mpc_pool_t *pool, mpc_result_t *r);
+int mpc_nparse_with(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_pool_t *pool, mpc_result_t *r);
+int mpc_parse_contents_with(const char *filename, mpc_parser_t *p, mpc_pool_t *pool, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -87,6 +107,7 @@ typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 
 mpc_parser_t *mpc_new(const char *name);
 mpc_parser_t *mpc_copy(mpc_parser_t *a);
+int mpc_id(mpc_parser_t *p);
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a);
 mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 
@@ -263,6 +284,7 @@ mpc_parser_t *mpc_re(const char *re);
 
 typedef struct mpc_ast_t {
   char *tag;
+  int tag_id;
   char *contents;
   mpc_state_t state;
   int children_num;
@@ -334,7 +356,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_MEMOISE              = 4,
+  MPCA_LANG_LAZY_ERRORS          = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -344,6 +368,9 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+mpc_err_t *mpca_table_write(FILE *f, const char *name, int n, ...);
+mpc_err_t *mpca_table_load(int flags, const unsigned char *table, int n, ...);
+
 /*
 ** Misc
 */
@@ -353,6 +380,15 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+typedef struct {
+  long lookups;
+  long hits;
+  long entries;
+} mpc_memo_stats_t;
+
+void mpc_memo_stats(mpc_memo_stats_t *s);
+void mpc_memo_stats_reset(void);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 
   mpc_dtor_t destructor, 